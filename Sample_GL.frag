@@ -2,6 +2,12 @@
 
 // Interpolated values from the vertex shaders
 in vec3 fragColor;
+in vec2 fragTileCoord;
+flat in int fragTileKind;
+
+uniform int drawmode;
+// corner and body colour of every tile kind
+uniform vec3 palette[6];
 
 // output data
 out vec3 color;
@@ -11,4 +17,13 @@ void main()
     // Output color = color specified in the vertex shader,
     // interpolated between all 3 surrounding vertices of the triangle
     color = fragColor;
+
+    if (drawmode == 2)
+    {
+        // A merged face covers several 2x2 tiles : fold the coordinate back into one tile
+        vec2 t = mix(fragTileCoord, mod(fragTileCoord, 2.0), step(2.001, fragTileCoord));
+        // Same blend as the two triangles of a createtile face, the corner colour fading out from (0,0)
+        float w = 1.0 - max(t.x, t.y)/2.0;
+        color = mix(palette[2*fragTileKind+1], palette[2*fragTileKind], w);
+    }
 }
@@ -3,11 +3,57 @@
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
+// per-instance data of the instanced board : cell offset and tile kind
+layout (location = 2) in vec2 tileOffset;
+layout (location = 3) in float tileKind;
+// position inside the tile(s) covered by a greedy meshed board face
+layout (location = 4) in vec2 tileCoord;
+// record of a multi-draw indirect command, one per instance starting at the command's baseInstance
+layout (location = 5) in int drawIndex;
 
-uniform mat4 MVP;
+// matrices of the frame
+layout (std140) uniform FrameMatrices
+{
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+};
+// model matrix of the object
+uniform mat4 M;
+// 0 : plain object, 1 : instanced board tile, 2 : greedy meshed board, 3 : board from the tile texture,
+// 4 : rolling block cube, 5 : static pack drawn indirect
+uniform int drawmode;
+// corner and body colour of every tile kind
+uniform vec3 palette[6];
+// tile texture : 0 for an empty cell, tile kind + 1 otherwise
+uniform usampler2D boardtiles;
+// rectangle of cells drawn : its first (column, row) and its size
+uniform ivec2 firstcell;
+uniform ivec2 drawncells;
+// centre of cell (0,0)
+uniform vec2 boardorigin;
+// rolling block : the roll happens in world space about the axis through the pivot edge,
+// by the angle still left to turn
+uniform vec3 rollpivot;
+uniform vec3 rollaxis;
+uniform float rollangle;
+// indirect draw records : 4 model matrix columns
+uniform samplerBuffer drawrecords;
+
+// corners of the 36 vertices of a tile, in the order createtile emits them
+const vec3 tilecorner[36] = vec3[36](
+    vec3(-1,-1,-1), vec3(-1,-1, 1), vec3( 1,-1, 1), vec3( 1,-1, 1), vec3( 1,-1,-1), vec3(-1,-1,-1),
+    vec3( 1, 1, 1), vec3(-1, 1, 1), vec3(-1, 1,-1), vec3(-1, 1,-1), vec3( 1, 1,-1), vec3( 1, 1, 1),
+    vec3(-1,-1, 1), vec3(-1,-1,-1), vec3(-1, 1,-1), vec3(-1, 1,-1), vec3(-1, 1, 1), vec3(-1,-1, 1),
+    vec3( 1, 1, 1), vec3( 1, 1,-1), vec3( 1,-1,-1), vec3( 1,-1,-1), vec3( 1,-1, 1), vec3( 1, 1, 1),
+    vec3(-1,-1, 1), vec3( 1,-1, 1), vec3( 1, 1, 1), vec3( 1, 1, 1), vec3(-1, 1, 1), vec3(-1,-1, 1),
+    vec3(-1,-1,-1), vec3( 1,-1,-1), vec3( 1, 1,-1), vec3( 1, 1,-1), vec3(-1, 1,-1), vec3(-1,-1,-1)
+);
 
 // output data : used by fragment shader
 out vec3 fragColor;
+out vec2 fragTileCoord;
+flat out int fragTileKind;
 
 void main ()
 {
@@ -17,6 +63,58 @@ void main ()
     // to produce the color of each fragment
     fragColor = vertexColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    if (drawmode == 1)
+    {
+        // Same colouring as createtile : the (-1,-1) corner gets the corner colour
+        int kind = int(tileKind);
+        if (vertexPosition.x == -1.0 && vertexPosition.y == -1.0)
+            fragColor = palette[2*kind];
+        else
+            fragColor = palette[2*kind+1];
+        v.xy += tileOffset;
+    }
+    else if (drawmode == 3)
+    {
+        // One instance per drawn cell, no vertex data : the cube comes from gl_VertexID
+        ivec2 cell = firstcell + ivec2(gl_InstanceID % drawncells.x, gl_InstanceID / drawncells.x);
+        int code = int(texelFetch(boardtiles, cell, 0).r);
+        if (code == 0)
+        {
+            // Empty cell : collapse the cube to a point
+            gl_Position = vec4(0, 0, 0, 1);
+            return;
+        }
+        vec3 corner = tilecorner[gl_VertexID];
+        if (corner.x < 0.0 && corner.y < 0.0)
+            fragColor = palette[2*(code-1)];
+        else
+            fragColor = palette[2*(code-1)+1];
+        v = vec4(corner * vec3(1, 1, 0.2), 1);
+        v.xy += boardorigin + vec2(2*cell.x, -2*cell.y);
+    }
+    else if (drawmode == 4)
+    {
+        vec3 w = (M * v).xyz - rollpivot;
+        float c = cos(rollangle), s = sin(rollangle);
+        w = w*c + cross(rollaxis, w)*s + rollaxis*dot(rollaxis, w)*(1.0 - c);
+        gl_Position = VP * vec4(w + rollpivot, 1);
+        return;
+    }
+    else if (drawmode == 5)
+    {
+        int record = 4*drawIndex;
+        mat4 model = mat4(texelFetch(drawrecords, record), texelFetch(drawrecords, record+1),
+                          texelFetch(drawrecords, record+2), texelFetch(drawrecords, record+3));
+        gl_Position = VP * model * v;
+        return;
+    }
+    else if (drawmode == 2)
+    {
+        // Merged faces are coloured per fragment, see Sample_GL.frag
+        fragTileCoord = tileCoord;
+        fragTileKind = int(tileKind);
+    }
+
+    // Output position of the vertex, in clip space : VP * M * position
+    gl_Position = VP * M * v;
 }
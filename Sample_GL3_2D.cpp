@@ -1,34 +1,42 @@
 #include <iostream>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
-#include <FTGL/ftgl.h>
+#include "fontatlas.h"
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 using namespace std;
 
 
-struct FTGLFont {
-	FTFont* font;
-	GLuint fontMatrixID;
-	GLuint fontColorID;
-} GL3Font;
-
 struct VAO {
     GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLuint VertexBuffer; // interleaved position + colour
+    GLuint IndexBuffer;
 
     GLenum PrimitiveMode;
     GLenum FillMode;
-    int NumVertices;
+    GLenum IndexType;
+    GLenum PositionType; // GL_FLOAT or GL_HALF_FLOAT
+    int Stride;
+    int NumVertices; // unique vertices in VertexBuffer
+    int NumIndices;
+    int PackBaseVertex, PackFirstIndex; // place in the static pack, -1 when not packed
 };
 typedef struct VAO VAO;
 
@@ -36,10 +44,27 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint DrawModeID;
+	GLuint BoardOriginID;
+	GLuint FirstCellID, DrawnCellsID;
+	GLuint ModelID;
+	GLuint RollPivotID, RollAxisID, RollAngleID;
 } Matrices;
 
-GLuint programID, fontProgramID, textureProgramID;;
+/* Matrices of the frame, written once per frame into the std140 uniform block FrameMatrices
+   that Sample_GL.vert reads, objects only send their model matrix */
+struct FrameMatrices {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 VP;
+} frame;
+#define FRAME_MATRICES_BINDING 0
+GLuint FrameMatricesBuffer;
+
+/* Values of the "drawmode" uniform in Sample_GL.vert */
+enum { DRAW_PLAIN, DRAW_TILE_INSTANCED, DRAW_TILE_MESHED, DRAW_TILE_TEXTURE, DRAW_BLOCK_ROLL, DRAW_INDIRECT };
+
+GLuint programID, textureProgramID, uiProgramID;
 
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
@@ -123,50 +148,227 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Only asks the main loop to end : the render thread still has the window, main stops it and tears down */
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-//    exit(EXIT_SUCCESS);
+    glfwSetWindowShouldClose(window, GL_TRUE);
+}
+
+
+/* Shadow of the GL state the draws keep changing : current program, bound VAO, polygon mode
+   and the attributes enabled in each VAO. Calls that would change nothing are skipped */
+struct GLStateShadow {
+    GLuint program;
+    GLuint vertexarray;
+    GLenum polygonmode;
+    std::map<GLuint, unsigned> enabledattribs; // bit mask of enabled attributes per VAO
+    long issued, skipped;                      // calls of the current frame
+    long totalissued, totalskipped, frames;
+} glstate;
+
+/* Set up the shadow from the GL defaults */
+void resetglstate ()
+{
+    glstate.program = 0;
+    glstate.vertexarray = 0;
+    glstate.polygonmode = GL_FILL;
+    glstate.enabledattribs.clear();
+    glstate.issued = glstate.skipped = 0;
+    glstate.totalissued = glstate.totalskipped = glstate.frames = 0;
+}
+
+void useprogram (GLuint program)
+{
+    if (glstate.program == program) {
+        glstate.skipped++;
+        return;
+    }
+    glstate.issued++;
+    glstate.program = program;
+    glUseProgram(program);
+}
+
+void bindvertexarray (GLuint vertexarray)
+{
+    if (glstate.vertexarray == vertexarray) {
+        glstate.skipped++;
+        return;
+    }
+    glstate.issued++;
+    glstate.vertexarray = vertexarray;
+    glBindVertexArray(vertexarray);
+}
+
+void setpolygonmode (GLenum mode)
+{
+    if (glstate.polygonmode == mode) {
+        glstate.skipped++;
+        return;
+    }
+    glstate.issued++;
+    glstate.polygonmode = mode;
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+/* Enable an attribute of the bound VAO, this is VAO state so it is tracked per VAO */
+void enableattrib (GLuint index)
+{
+    unsigned &mask = glstate.enabledattribs[glstate.vertexarray];
+    if (mask & (1u << index)) {
+        glstate.skipped++;
+        return;
+    }
+    glstate.issued++;
+    mask |= 1u << index;
+    glEnableVertexAttribArray(index);
+}
+
+/* Delete a VAO, its id can be handed out again so the shadow must not remember it */
+void deletevertexarray (GLuint vertexarray)
+{
+    if (glstate.vertexarray == vertexarray)
+        glstate.vertexarray = (GLuint)-1;
+    glstate.enabledattribs.erase(vertexarray);
+    glDeleteVertexArrays(1, &vertexarray);
+}
+
+/* Close the counters of a frame */
+void glstateframe ()
+{
+    glstate.totalissued += glstate.issued;
+    glstate.totalskipped += glstate.skipped;
+    glstate.frames++;
+    glstate.issued = glstate.skipped = 0;
+}
+
+void reportglstate ()
+{
+    if (glstate.frames == 0)
+        return;
+    cout << "GL state : " << glstate.totalskipped << " redundant calls skipped, " << glstate.totalissued
+         << " issued over " << glstate.frames << " frames (" << (double)glstate.totalskipped/glstate.frames
+         << " skipped, " << (double)glstate.totalissued/glstate.frames << " issued per frame)" << endl;
 }
 
+/* Key used to weld vertices that share both position and colour */
+struct VertexKey {
+    GLfloat v[6];
+    bool operator< (const VertexKey& k) const {
+        for (int i=0; i<6; i++)
+            if (v[i] != k.v[i])
+                return v[i] < k.v[i];
+        return false;
+    }
+};
+
+/* Static pack : every triangle mesh is also appended to one shared vertex and index buffer
+   (float positions, 16 bit indices relative to the mesh's base vertex) for multi-draw indirect */
+std::vector<unsigned char> packvertices;
+std::vector<GLushort> packindices;
 
 /* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Duplicate vertices are welded into an index buffer and each unique vertex is stored interleaved as
+   position (3 floats, or 3 half floats + padding) followed by its colour as 4 normalized bytes */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, GLenum position_type=GL_FLOAT)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->PositionType = position_type;
+    vao->Stride = (position_type == GL_HALF_FLOAT) ? 12 : 16;
+
+    // Weld the vertex stream into unique vertices and indices
+    std::map<VertexKey, GLuint> unique;
+    std::vector<VertexKey> vertices;
+    std::vector<GLuint> indices(numVertices);
+    for (int i=0; i<numVertices; i++) {
+        VertexKey key;
+        for (int j=0; j<3; j++) {
+            key.v[j] = vertex_buffer_data[3*i + j];
+            key.v[3 + j] = color_buffer_data[3*i + j];
+        }
+        std::map<VertexKey, GLuint>::iterator it = unique.find(key);
+        if (it == unique.end()) {
+            it = unique.insert(std::make_pair(key, (GLuint)vertices.size())).first;
+            vertices.push_back(key);
+        }
+        indices[i] = it->second;
+    }
+    vao->NumVertices = vertices.size();
+    vao->NumIndices = numVertices;
+
+    vao->PackBaseVertex = vao->PackFirstIndex = -1;
+    if (primitive_mode == GL_TRIANGLES && vao->NumVertices <= 65536) {
+        vao->PackBaseVertex = packvertices.size() / 16;
+        vao->PackFirstIndex = packindices.size();
+        for (int i=0; i<vao->NumVertices; i++) {
+            unsigned char p[16];
+            memcpy(p, vertices[i].v, 3*sizeof(GLfloat));
+            for (int j=0; j<3; j++)
+                p[12 + j] = (unsigned char)(glm::clamp(vertices[i].v[3 + j], 0.0f, 1.0f) * 255.0f + 0.5f);
+            p[15] = 255;
+            packvertices.insert(packvertices.end(), p, p + 16);
+        }
+        packindices.insert(packindices.end(), indices.begin(), indices.end());
+    }
+
+    // Pack the interleaved vertices
+    std::vector<unsigned char> packed(vao->NumVertices * vao->Stride, 0);
+    for (int i=0; i<vao->NumVertices; i++) {
+        unsigned char* p = &packed[i * vao->Stride];
+        if (position_type == GL_HALF_FLOAT) {
+            GLushort half[3];
+            for (int j=0; j<3; j++)
+                half[j] = glm::packHalf1x16(vertices[i].v[j]);
+            memcpy(p, half, sizeof(half));
+        }
+        else
+            memcpy(p, vertices[i].v, 3*sizeof(GLfloat));
+        unsigned char* color = p + vao->Stride - 4;
+        for (int j=0; j<3; j++)
+            color[j] = (unsigned char)(glm::clamp(vertices[i].v[3 + j], 0.0f, 1.0f) * 255.0f + 0.5f);
+        color[3] = 255;
+    }
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - interleaved vertices
+    glGenBuffers (1, &(vao->IndexBuffer));  // IBO - indices
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    bindvertexarray (vao->VertexArrayID); // Bind the VAO
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+    glBufferData (GL_ARRAY_BUFFER, packed.size(), &packed[0], GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
                           3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
+                          position_type,      // type
                           GL_FALSE,           // normalized?
-                          0,                  // stride
+                          vao->Stride,        // stride
                           (void*)0            // array buffer offset
                           );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
                           3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
+                          GL_UNSIGNED_BYTE,   // type
+                          GL_TRUE,            // normalized?
+                          vao->Stride,        // stride
+                          (void*)(intptr_t)(vao->Stride - 4) // array buffer offset
                           );
+    enableattrib(0);
+    enableattrib(1);
+
+    // 16 bit indices whenever they are enough
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer); // Bind the IBO, recorded in the VAO
+    if (vao->NumVertices <= 65536) {
+        std::vector<GLushort> shortindices(indices.begin(), indices.end());
+        vao->IndexType = GL_UNSIGNED_SHORT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, numVertices*sizeof(GLushort), &shortindices[0], GL_STATIC_DRAW);
+    }
+    else {
+        vao->IndexType = GL_UNSIGNED_INT;
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, numVertices*sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+    }
 
     return vao;
 }
@@ -181,9 +383,12 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
 }
 
+void submittext(const char *text,glm::mat4 model,glm::vec3 colour);
 void display_end(char *str){
 	Matrices.model = glm::mat4(1.0f);
 	glm::vec3 fontColor = glm::vec3(0,0,0);
@@ -191,35 +396,22 @@ void display_end(char *str){
 	float fontScaleValue = 40 ;
 	glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
 	Matrices.model *= (translateText * scaleText);
-	glm::mat4 MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render(str);
+	submittext(str,Matrices.model,fontColor);
 	translateText = glm::translate(glm::vec3(0,-1,0));
 	Matrices.model *= (translateText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render("Press R to restart the level, Q to quit");
+	submittext("Press R to restart the level, Q to quit",Matrices.model,fontColor);
 	translateText = glm::translate(glm::vec3(0,-1,0));
 	Matrices.model *= (translateText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render("Press B to go back to previous level");
+	submittext("Press B to go back to previous level",Matrices.model,fontColor);
 }
 
 void display_string(float x,float y,char *str,float fontScaleValue){
 	glm::vec3 fontColor = glm::vec3(0,0,0);
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateText = glm::translate(glm::vec3(x,y,0));
 	glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
 	Matrices.model *= (translateText * scaleText);
-	glm::mat4 MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render(str);
+	submittext(str,Matrices.model,fontColor);
 
 }
 
@@ -227,23 +419,13 @@ void display_string(float x,float y,char *str,float fontScaleValue){
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    setpolygonmode (vao->FillMode);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Bind the VAO to use, its attribute pointers and enabled attributes were set up by create3DObject
+    bindvertexarray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
-
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    // Draw the geometry ! The index buffer is part of the VAO state
+    glDrawElements(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0);
 }
 
 /**************************
@@ -256,162 +438,415 @@ bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
 
 
+/* The 24 orientations of a cube as exact rotation matrices (row major), orientation 0 is the identity */
+constexpr int orientationtable[24][3][3]={
+  {{ 1, 0, 0},{ 0, 1, 0},{ 0, 0, 1}},
+  {{ 0, 0, 1},{ 0, 1, 0},{-1, 0, 0}},
+  {{ 0, 0,-1},{ 0, 1, 0},{ 1, 0, 0}},
+  {{ 1, 0, 0},{ 0, 0, 1},{ 0,-1, 0}},
+  {{ 1, 0, 0},{ 0, 0,-1},{ 0, 1, 0}},
+  {{-1, 0, 0},{ 0, 1, 0},{ 0, 0,-1}},
+  {{ 0, 0, 1},{-1, 0, 0},{ 0,-1, 0}},
+  {{ 0, 0, 1},{ 1, 0, 0},{ 0, 1, 0}},
+  {{ 0, 0,-1},{ 1, 0, 0},{ 0,-1, 0}},
+  {{ 0, 0,-1},{-1, 0, 0},{ 0, 1, 0}},
+  {{ 0,-1, 0},{ 0, 0, 1},{-1, 0, 0}},
+  {{ 0, 1, 0},{ 0, 0, 1},{ 1, 0, 0}},
+  {{ 1, 0, 0},{ 0,-1, 0},{ 0, 0,-1}},
+  {{ 0, 1, 0},{ 0, 0,-1},{-1, 0, 0}},
+  {{ 0,-1, 0},{ 0, 0,-1},{ 1, 0, 0}},
+  {{-1, 0, 0},{ 0, 0,-1},{ 0,-1, 0}},
+  {{-1, 0, 0},{ 0, 0, 1},{ 0, 1, 0}},
+  {{ 0,-1, 0},{-1, 0, 0},{ 0, 0,-1}},
+  {{ 0, 1, 0},{-1, 0, 0},{ 0, 0, 1}},
+  {{ 0, 0, 1},{ 0,-1, 0},{ 1, 0, 0}},
+  {{ 0, 1, 0},{ 1, 0, 0},{ 0, 0,-1}},
+  {{ 0,-1, 0},{ 1, 0, 0},{ 0, 0, 1}},
+  {{ 0, 0,-1},{ 0,-1, 0},{-1, 0, 0}},
+  {{-1, 0, 0},{ 0,-1, 0},{ 0, 0, 1}}
+};
+/* Quarter turns a move can make, new pose = turn * old pose */
+enum { TURN_RIGHT, TURN_LEFT, TURN_UP, TURN_DOWN, TURNS };
+/* Orientation reached from each orientation by each turn */
+constexpr int orientationturn[24][TURNS]={
+  { 1, 2, 3, 4},
+  { 5, 0, 6, 7},
+  { 0, 5, 8, 9},
+  {10,11,12, 0},
+  {13,14, 0,12},
+  { 2, 1,15,16},
+  {17,18,19, 1},
+  {20,21, 1,19},
+  {21,20,22, 2},
+  {18,17, 2,22},
+  {16, 3,17,21},
+  { 3,16,20,18},
+  {22,19, 4, 3},
+  {15, 4,18,20},
+  { 4,15,21,17},
+  {14,13,23, 5},
+  {11,10, 5,23},
+  { 9, 6,14,10},
+  { 6, 9,11,13},
+  {12,23, 7, 6},
+  { 8, 7,13,11},
+  { 7, 8,10,14},
+  {23,12, 9, 8},
+  {19,22,16,15}
+};
+/* Roll axis and angle (degrees) of every turn, used by the roll animation */
+const glm::vec3 turnaxis[TURNS]={glm::vec3(0,1,0),glm::vec3(0,1,0),glm::vec3(1,0,0),glm::vec3(1,0,0)};
+const float turnangle[TURNS]={90,-90,-90,90};
+glm::mat4 orientationmatrix[24];
+
 typedef struct h
 {
   float l,w,h,x1,y1,z1,x2,y2,z2,goal_x,goal_y,translatex,translatey,angley,anglex;
-  glm::mat4 rotationmatrix[2];
+  /* Index into orientationtable of each cube */
+  int orientation[2];
+  /* Roll animation of the last move : each cube turns about rollaxis through rollpivot by rollangle degrees,
+     orientation and the position already hold the pose at the end of the roll */
+  double rollstart;
+  glm::vec3 rollaxis,rollpivot[2];
+  float rollangle[2];
 }blocks;
 blocks block;
-int a[100][100],board_length,board_width,level=1,levelcount=0,gamestart=0,view=0;
+/* The board : a[i][j] is the tile at row i, column j, 0 for none, 1 normal, 2 fragile.
+   One flat array so that generated levels can be far larger than the built-in ones, with a border
+   of empty cells so that the cells just off the board read as holes.
+   initialiselevel builds a level in a, which then becomes levelboard : never changed again and shared
+   as is by the game and the render thread, each keeping the cells changed since on the side (see
+   boardcell and showncell), so that neither copies the board when a level starts */
+#define BOARD_BORDER 2
+struct Board {
+  int rows,cols,stride;
+  vector<int> cells;
+  int *operator[](int i) { return &cells[(i+BOARD_BORDER)*stride+BOARD_BORDER]; }
+  const int *operator[](int i) const { return &cells[(i+BOARD_BORDER)*stride+BOARD_BORDER]; }
+  int index(int i,int j) const { return (i+BOARD_BORDER)*stride+j+BOARD_BORDER; }
+  void resize(int r,int c)
+  {
+    rows=r;
+    cols=c;
+    stride=c+2*BOARD_BORDER;
+    cells.assign((r+2*BOARD_BORDER)*stride,0);
+  }
+} a;
+/* The game's board : the level as built and the cells the game set on it since, by index */
+shared_ptr<const Board> levelboard,generatedboard;
+map<int,int> playedcells;
+int boardcell(int i,int j)
+{
+  if(!playedcells.empty())
+  {
+    map<int,int>::const_iterator cell=playedcells.find(levelboard->index(i,j));
+    if(cell!=playedcells.end())
+    return cell->second;
+  }
+  return (*levelboard)[i][j];
+}
+/* The render thread's board, kept up to date through the snapshots */
+shared_ptr<const Board> shownboard;
+map<int,int> showncells;
+int showncell(int i,int j)
+{
+  if(!showncells.empty())
+  {
+    map<int,int>::const_iterator cell=showncells.find(shownboard->index(i,j));
+    if(cell!=showncells.end())
+    return cell->second;
+  }
+  return (*shownboard)[i][j];
+}
+/* Side of the level generated in place of level 1, from the command line; 0 plays the built-in one */
+int generatedsize=0;
+int board_length,board_width,level=1,levelcount=0,gamestart=0,view=0;
+/* Values of view */
+enum { VIEW_TOWER, VIEW_TOP, VIEW_BACK, VIEW_HELICOPTER, VIEW_BLOCK, VIEW_FOLLOW, VIEWS };
+const char *viewname[VIEWS]={"TOWER VIEW","TOP VIEW","BACK VIEW","HELICOPTER VIEW","BLOCK VIEW","FOLLOW CAM VIEW"};
 int active_circle=0,active_rectangle=0,active_into=0,breakblock=0,presentblock=-1,leftmouse=0;
-float right_angle,left_angle,up_angle,down_angle,zshift=4,namefall=0;
+float zshift=4,namefall=0;
+/* Seconds a roll takes */
+#define ROLL_TIME 0.12
+/* Fixed timestep : the game advances in update() by UPDATE_TICK at a time whatever the frame rate, and
+   draw() shows it between the last two ticks. The height the level drops in from is interpolated into
+   zshift, which the renderers read, and rolls are timed on gametime, the clock of the ticks */
+#define UPDATE_TICK (1.0/60)
+#define MAX_TICKS_PER_FRAME 15 // after a longer stall the game skips time instead of catching up
+double gametime=0;
+float levelshift=4,lastlevelshift=4; // after and before the last tick
 double start_time,current_time,game_over_time,viewtime,mouse_x,mouse_y,lgx,lgy;
-void func(int a,float b,char *c,int x,int y);
+/* On-demand rendering : while nothing on screen moves, the main loop sleeps until input arrives or the HUD
+   next changes instead of drawing the same frame at vsync. Frames are never started faster than
+   maxframerate (0 for no limit, "-fps" on the command line), BACKGROUND_FRAME_RATE while the window is
+   not focused, and not at all while it is iconified */
+#define FRAME_RATE_LIMIT 60
+#define BACKGROUND_FRAME_RATE 10
+bool ondemand=true,focused=true,iconified=false,redraw=true;
+double maxframerate=FRAME_RATE_LIMIT;
+long loopframes=0,idleframes=0;
+/* "-stats" on the command line prints the frame, GL state, render queue, UI and input counters at exit */
+bool printstats=false;
+void func(int a,float b,const char *c,int x,int y);
 void func1(int a,float b,char c[],int x,int y,float z);
 //tiles block;
-int num_of_tiles=00,rightmove=0,checkarrow=0,lives=3,presentlives=0,moves[]={0,8,18,28,11},present_moves[]={0,14,24,34,17};
+int num_of_tiles=00,rightmove=0,lives=3,presentlives=0,moves[]={0,8,18,28,11},present_moves[]={0,14,24,34,17};
 int checkstate();
 void changestateto(int state);
 void addcoordinates(float x,float y,float x1,float y1);
 void checkupordown(int p);
 void rightkeypressed(float h1,float h2,float h3,float h4,float h5,float h6,float h7,float h8);
 void upkeypressed(float h1,float h2,float h3,float h4,float h5,float h6,float h7,float h8);
+void startroll(int turn,glm::vec3 dir);
+
+/* Tile kinds drawn on the board, each with its own cached mesh */
+enum { TILE_NORMAL, TILE_FRAGILE, TILE_SPLIT, TILE_KINDS };
+VAO *tilecache[TILE_KINDS];
+/* Corner and body colour of every tile kind, shared with the instanced shader */
+GLfloat tilepalette[TILE_KINDS][2][3]={
+  {{0.87,0.87,0.87},{0.627,0.627,0.627}},
+  {{1,0.5,0},{1,0.7,0.4}},
+  {{0,0,0},{0,0,0}}
+};
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Cells of a[][] that can hold tiles */
+#define BOARD_SIZE 20
+
+/* Ways of drawing the board, cycled with M */
+enum { BOARD_TILES, BOARD_INSTANCED, BOARD_BAKED, BOARD_MESHED, BOARD_TEXTURE, BOARD_CHUNKED, BOARD_MODES };
+const char *boardmodename[BOARD_MODES]={"TILES","INSTANCED","BAKED","MESHED","TEXTURE","CHUNKED"};
+/* boardversion is bumped on every board change; each renderer remembers the version it uploaded */
+int boardmode=BOARD_MESHED,boardversion=1,num_tile_instances=0,instancedversion=0,instancedvisible=-1;
+/* Static objects are drawn with multi-draw indirect when the driver has it and it is not switched off */
+bool indirectavailable=false,indirectdraw=true;
+GLuint BoardArrayID,TileInstanceBuffer;
+/* Greedy meshed board: only visible faces, coplanar faces of same-kind tiles merged */
+GLuint MeshedArrayID,MeshedBuffer;
+int meshedversion=0;
+/* Faces are merged only inside chunks of MESH_CHUNK x MESH_CHUNK cells, each chunk's vertices are contiguous
+   so that a culled view draws just the chunks it can see */
+#define MESH_CHUNK 8
+#define MESH_CHUNKS ((BOARD_SIZE+MESH_CHUNK-1)/MESH_CHUNK)
+GLint meshchunkfirst[MESH_CHUNKS*MESH_CHUNKS];
+GLsizei meshchunkcount[MESH_CHUNKS*MESH_CHUNKS];
+/* Baked board: one buffer with a fixed 36-vertex slot per cell, patched per dirty cell */
+GLuint BakedArrayID,BakedBuffer;
+int bakedcell[BOARD_SIZE][BOARD_SIZE],bakedlength=-1,bakedwidth=-1,tilequeued[BOARD_SIZE][BOARD_SIZE];
+vector<int> dirtytiles;
+/* Bufferless board: the grid lives in an R8UI texture and the vertex shader builds the cubes */
+GLuint BoardTexture,EmptyArrayID;
+int texturedlength=-1,texturedwidth=-1;
+int texturedcell[BOARD_SIZE][BOARD_SIZE];   // codes the texture holds, as bakedcell for the baked buffer
+/* Chunked board, the only renderer that covers boards of any size : BOARD_CHUNK x BOARD_CHUNK cells
+   greedy meshed into a buffer of their own when the chunk first comes into view, and rebuilt only when
+   one of its cells changed. Chunks unseen for CHUNK_KEEP frames, or the oldest ones past CHUNK_BUDGET,
+   give their buffers back */
+#define BOARD_CHUNK 32
+#define CHUNK_BUILDS_PER_FRAME 16
+#define CHUNK_KEEP 300
+#define CHUNK_BUDGET 256
+struct BoardChunk {
+  GLuint vao,buffer;   // 0 while the chunk is not resident
+  int vertices;
+  int stamp,built;     // stamp of the last change to its cells, stamp its buffer was built from
+  int lastseen;        // frame it was last drawn in
+};
+vector<BoardChunk> chunks;
+vector<int> residentchunks;
+int chunkrows=0,chunkcols=0,chunkstamp=0,chunkframe=0;
+
+/* Dynamic resolution, toggled with R : the scene is drawn offscreen at renderscale of the framebuffer size
+   and stretched onto the window, the HUD is then drawn over it at full size.
+   updaterenderscale steers the scale so that frames fit in FRAME_BUDGET */
+#define FRAME_BUDGET (1.0/60)
+#define MIN_RENDER_SCALE 0.5f
+#define SCENE_TIMERS 4
+#define RENDER_SCALE_SETTLE 10
+#define RENDER_SCALE_PATIENCE 120
+bool dynamicresolution=false;
+float renderscale=1;
+int framewidth=1000,frameheight=1000;       // framebuffer size the render thread draws at
+GLuint SceneFramebuffer,SceneColour,SceneDepth;
+int scenewidth=0,sceneheight=0;             // size the offscreen buffers were allocated for
+GLuint scenetimers[SCENE_TIMERS];           // GPU time of the scene, read back SCENE_TIMERS-1 frames later
+bool scenetimerissued[SCENE_TIMERS],scaledscene=false;
+int scenetimer=0,settleframes=0,ontimeframes=0;
+double gpuscenetime=0,cpuframetime=0;       // smoothed over recent frames
+
+/* Render thread : the GL context lives on a thread of its own that draws snapshots of the game, so that
+   the game and input never wait on the driver or the swap. After its ticks the main thread fills the back
+   slot of a lock-free triple buffer and swaps it with the middle one; the render thread swaps its front
+   slot with the middle one whenever that holds a snapshot it has not taken. Cells the game changed go
+   along as a list that is only cut once the render thread took a snapshot holding them, so a snapshot it
+   skips loses nothing; replaying cells it already has is harmless */
+struct Snapshot {
+  blocks block;
+  int level,lives,moves,gamestart,view,board_length,board_width;
+  float levelshift,lastlevelshift,camera_rotation_angle;
+  double gametime,start_time,viewtime;
+  double lag,published;            // game time not played yet, and when the snapshot was published
+  bool dragging;                   // the helicopter camera turns by how far the cursor is from draganchor
+  double draganchor;
+  double inputtime;                // when the oldest key or button it shows came in, 0 for none
+  int windowwidth,windowheight;    // framebuffer size
+  int boardmode;                   // renderer settings, switched from the keyboard
+  bool indirectdraw,dynamicresolution;
+  int boardserial;                 // boards of new levels handed over so far
+  shared_ptr<const Board> board;   // the last of them, until the render thread has it
+  vector<int> changes;             // cells set on it since, as row, column, value
+};
+#define SNAPSHOT_FRESH 4
+Snapshot snapshots[3];
+atomic<int> middlesnapshot(1);               // slot in the middle, with SNAPSHOT_FRESH until it is taken
+int backsnapshot=0,frontsnapshot=2;          // slots of the main and of the render thread
+const Snapshot *shown=&snapshots[2];         // what the render thread draws
+/* Renderer settings as the keyboard leaves them, the render thread picks them up from the snapshots */
+struct RenderSettings {
+  int boardmode;
+  bool indirectdraw,dynamicresolution;
+} settings={BOARD_MESHED,true,false};
+/* Main thread's side of the board : the last board handed over, the cells set on it that the render
+   thread may not have yet, and how many of them went with the last snapshot */
+shared_ptr<const Board> handedboard;
+vector<int> boardchanges;
+int boardserial=0,sentserial=0,sentchanges=0;
+int windowwidth=1000,windowheight=1000;      // framebuffer size, set by reshapeWindow
+int screenwidth=1000,screenheight=1000;      // window size in screen coordinates, the cursor's units
+atomic<bool> rendering(true);
+mutex rendermutex;                           // only held to wait on and wake the render thread
+condition_variable renderwake;
+long snapshotspublished=0,snapshotsdrawn=0;
+
+/* Change a cell of the game's board, the render thread gets it with the next snapshot */
+void setcell(int i,int j,int v)
+{
+  if(boardcell(i,j)!=v)
+  {
+    playedcells[levelboard->index(i,j)]=v;
+    boardchanges.push_back(i);
+    boardchanges.push_back(j);
+    boardchanges.push_back(v);
+  }
+}
+/* Called once the board of a new level is in a[][], or in generatedboard : it becomes levelboard
+   and the render thread gets it along, both without a copy */
+void handboard()
 {
-     // Function is called first on GLFW_PRESS.
+  if(level==1 && generatedsize>0)
+  levelboard=generatedboard;
+  else
+  levelboard=shared_ptr<const Board>(new Board(std::move(a)));
+  playedcells.clear();
+  handedboard=levelboard;
+  boardserial++;
+  boardchanges.clear();
+  sentchanges=0;
+}
 
-    if (action == GLFW_RELEASE) {
-      if(key==GLFW_KEY_RIGHT || key==GLFW_KEY_LEFT || key==GLFW_KEY_UP || key==GLFW_KEY_DOWN)
-      checkarrow=0;
-    }
-    else if (action == GLFW_PRESS) {
+/* Move commands : the arrow keys and the arrow pad on screen queue a TURN_* roll, B queues MOVE_SELECT.
+   update() plays them one at a time as the roll before ends, so quick presses wait their turn instead
+   of cutting a roll short; past MOVE_QUEUE waiting, more are dropped */
+#define MOVE_SELECT TURNS
+#define MOVE_QUEUE 4
+int movequeue[MOVE_QUEUE],movefirst=0,movecount=0;
+void queuemove(int move)
+{
+  if(movecount<MOVE_QUEUE)
+  movequeue[(movefirst+movecount++)%MOVE_QUEUE]=move;
+}
+/* Play a move command, the one path every move of the block takes */
+void moveblock(int move)
+{
+  static const glm::vec3 movedir[TURNS]={glm::vec3(1,0,0),glm::vec3(-1,0,0),glm::vec3(0,1,0),glm::vec3(0,-1,0)};
+  if(move==MOVE_SELECT)
+  {
+    presentblock=1-presentblock;
+    return;
+  }
+  system("mpg123 -vC sounds/1.mp3 &");
+  present_moves[level]--;
+  if(breakblock==0)
+  {
+    if(move==TURN_RIGHT)
+    rightkeypressed(2,4,-2,2,2,4,2,2);
+    else if(move==TURN_LEFT)
+    rightkeypressed(-4,-2,-2,-2,-2,-2,-4,2);
+    else if(move==TURN_UP)
+    upkeypressed(2,4,-2,4,2,2,2,2);
+    else
+    upkeypressed(-4,-2,-2,-2,-4,2,-2,-2);
+  }
+  else
+  {
+    // the block is split : only the selected cube moves, and none until one is selected
+    if(presentblock==-1)
+    return;
+    float &x=(presentblock==0)?block.x1:block.x2,&y=(presentblock==0)?block.y1:block.y2;
+    x+=2*movedir[move].x;
+    y+=2*movedir[move].y;
+  }
+  startroll(move,movedir[move]);
+  // level 2 : rolling onto a switch flips its bridge
+  if(((int)block.x1==-12 && (int)block.y1==-2) || ((int)block.x2==-12 && (int)block.y2==-2))
+  active_circle=1-active_circle;
+  if((int)block.x1==0 && block.y1==0 && block.x2==0 && block.y2==0)
+  active_into=1-active_into;
+}
+/* Plays a regular key pressed/released, time being when it happened */
+void playkey (int key, int action, double time)
+{
+    if (action == GLFW_PRESS) {
       if(key==GLFW_KEY_RIGHT)
-      {
-				  system("mpg123 -vC sounds/1.mp3 &");
-					present_moves[level]--;
-          checkarrow=1;
-          if(breakblock==0)
-          {
-          right_angle=45;
-          rightkeypressed(2,4,-2,2,2,4,2,2);
-          }
-          else
-          {
-            if(presentblock!=-1)
-            {
-            right_angle=90;
-            if(presentblock==0)
-            block.x1+=2;
-            else
-            block.x2+=2;
-            }
-          }
-      }
+      queuemove(TURN_RIGHT);
       else if(key==GLFW_KEY_LEFT)
-      {
-				system("mpg123 -vC sounds/1.mp3 &");
-				present_moves[level]--;
-        checkarrow=1;
-        if(breakblock==0)
-        {
-        left_angle=45;
-        rightkeypressed(-4,-2,-2,-2,-2,-2,-4,2);
-        }
-        else
-        {
-          if(presentblock!=-1)
-          {
-          left_angle=90;
-          if(presentblock==0)
-          block.x1-=2;
-          else
-          block.x2-=2;
-          }
-        }
-      }
+      queuemove(TURN_LEFT);
       else if(key==GLFW_KEY_UP)
-      {
-				system("mpg123 -vC sounds/1.mp3 &");
-				present_moves[level]--;
-        checkarrow=1;
-        if(breakblock==0)
-        {
-        up_angle=45;
-        upkeypressed(2,4,-2,4,2,2,2,2);
-        }
-        else
-        {
-          if(presentblock!=-1)
-          {
-          up_angle=90;
-          if(presentblock==0)
-          block.y1+=2;
-          else
-          block.y2+=2;
-          }
-        }
-      }
+      queuemove(TURN_UP);
       else if(key==GLFW_KEY_DOWN)
-      {
-			system("mpg123 -vC sounds/1.mp3 &");
-			present_moves[level]--;
-      checkarrow=1;
-      if(breakblock==0)
-      {
-      down_angle=45;
-      upkeypressed(-4,-2,-2,-2,-4,2,-2,-2);
-      }
-      else
-      {
-        if(presentblock!=-1)
-        {
-        down_angle=90;
-        if(presentblock==0)
-        block.y1-=2;
-        else
-        block.y2-=2;
-        }
-      }
-      }
+      queuemove(TURN_DOWN);
       else if(key==GLFW_KEY_B)
-      {
-        presentblock=1-presentblock;
-      }
+      queuemove(MOVE_SELECT);
 			else if(key==GLFW_KEY_ENTER)
 			{
 				gamestart=1;
 			}
 			else if(key==GLFW_KEY_Q)
 			{
-			  char level_str[30];
-			  sprintf(level_str,"CONGRATS!! YOU COMPLETED %d LEVELS	",level-1);
-			 	func(100,3,level_str,-15,0);
+				// draw() shows the levels completed once gamestart is 2
 				gamestart=2;
 			  //exit(0);
 		  }
 			else if(key==GLFW_KEY_V)
 			{
-				view=(view+1)%6;
-				viewtime=glfwGetTime();
+				view=(view+1)%VIEWS;
+				viewtime=time;
+			}
+			else if(key==GLFW_KEY_M)
+			{
+				// the other renderers only cover the first BOARD_SIZE rows and columns
+				if(generatedsize>0)
+				cout<<"BOARD RENDERER: "<<boardmodename[BOARD_CHUNKED]<<", the only one for a generated level"<<endl;
+				else
+				{
+				settings.boardmode=(settings.boardmode+1)%BOARD_MODES;
+				cout<<"BOARD RENDERER: "<<boardmodename[settings.boardmode]<<endl;
+				}
+			}
+			else if(key==GLFW_KEY_I)
+			{
+				settings.indirectdraw=!settings.indirectdraw;
+				cout<<"INDIRECT DRAWING: "<<(settings.indirectdraw && indirectavailable?"ON":"OFF")<<endl;
+			}
+			else if(key==GLFW_KEY_R)
+			{
+				settings.dynamicresolution=!settings.dynamicresolution;
+				cout<<"DYNAMIC RESOLUTION: "<<(settings.dynamicresolution?"ON":"OFF")<<endl;
+			}
+			else if(key==GLFW_KEY_E)
+			{
+				ondemand=!ondemand;
+				cout<<"ON-DEMAND RENDERING: "<<(ondemand?"ON":"OFF")<<endl;
 			}
-//      cout<<block.x1<<" "<<block.y1<<" "<<block.x2<<" "<<block.y2<<endl;
-      if(checkarrow==1)
-      {
-      if((int)block.x1==-12 && (int)block.y1==-2)
-      {
-        active_circle=1-active_circle;
-      }
-      else if((int)block.x2==-12 && (int)block.y2==-2)
-      {
-        active_circle=1-active_circle;
-      }
-      if((int)block.x1==0 && block.y1==0 && block.x2==0 && block.y2==0)
-      active_into=1-active_into;
-      //cout<<active_circle<<endl;
-      }
      }
 }
 
@@ -428,100 +863,35 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 	}
 }
 
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* The cursor in the units of the UI projection : the 40x40 square widened on the longer side */
+glm::vec2 cursortoui(double x,double y)
+{
+  float aspect=(float)screenwidth/screenheight,halfwidth=20,halfheight=20;
+  if(aspect>=1)
+  halfwidth*=aspect;
+  else
+  halfheight/=aspect;
+  return glm::vec2((2*x/screenwidth-1)*halfwidth,(1-2*y/screenheight)*halfheight);
+}
+/* Plays a mouse button pressed/released at the cursor position in mouse_x, mouse_y */
+void playbutton (int button, int action)
 {
 	if(action==GLFW_PRESS)
  {
 	if(button==GLFW_MOUSE_BUTTON_LEFT)
 	{
 		leftmouse=1;
-    glfwGetCursorPos(window, &mouse_x, &mouse_y);
 		cout<<mouse_x<<" "<<mouse_y<<endl;
-		if(fabs(736-mouse_x)+fabs(816-mouse_y)<50)
-		{
-			present_moves[level]--;
-			checkarrow=1;
-			if(breakblock==0)
-			{
-			left_angle=45;
-			rightkeypressed(-4,-2,-2,-2,-2,-2,-4,2);
-			}
-			else
-			{
-				if(presentblock!=-1)
-				{
-				left_angle=90;
-				if(presentblock==0)
-				block.x1-=2;
-				else
-				block.x2-=2;
-				}
-			}
-		}
-		else if(fabs(798-mouse_x)+fabs(mouse_y-744)<50)
-		{
-			present_moves[level]--;
-			checkarrow=1;
-			if(breakblock==0)
-			{
-			up_angle=45;
-			upkeypressed(2,4,-2,4,2,2,2,2);
-			}
-			else
-			{
-				if(presentblock!=-1)
-				{
-				up_angle=90;
-				if(presentblock==0)
-				block.y1+=2;
-				else
-				block.y2+=2;
-				}
-			}
-		}
-		else if(fabs(mouse_x-868)+fabs(mouse_y-800)<50)
-		{
-			present_moves[level]--;
-			checkarrow=1;
-			if(breakblock==0)
-			{
-			right_angle=45;
-			rightkeypressed(2,4,-2,2,2,4,2,2);
-			}
-			else
-			{
-				if(presentblock!=-1)
-				{
-				right_angle=90;
-				if(presentblock==0)
-				block.x1+=2;
-				else
-				block.x2+=2;
-				}
-			}
-		}
+		// the arrow pad, in the UI units it is drawn in : left, up and right, anywhere else rolls down
+		glm::vec2 ui=cursortoui(mouse_x,mouse_y);
+		if(fabs(ui.x-9.44)+fabs(ui.y+12.64)<2)
+		queuemove(TURN_LEFT);
+		else if(fabs(ui.x-11.92)+fabs(ui.y+9.76)<2)
+		queuemove(TURN_UP);
+		else if(fabs(ui.x-14.72)+fabs(ui.y+12)<2)
+		queuemove(TURN_RIGHT);
 		else
-		{
-			present_moves[level]--;
-      checkarrow=1;
-      if(breakblock==0)
-      {
-      down_angle=45;
-      upkeypressed(-4,-2,-2,-2,-4,2,-2,-2);
-      }
-      else
-      {
-        if(presentblock!=-1)
-        {
-        down_angle=90;
-        if(presentblock==0)
-        block.y1-=2;
-        else
-        block.y2-=2;
-        }
-      }
-		}
+		queuemove(TURN_DOWN);
 		//
 		//mouse_x=(2*mouse_x-1000)/50;
 		// mouse_y=(2*mouse_y-1000)/50;
@@ -536,7 +906,195 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 	 }
  }
  if(view==3 && leftmouse==1)
-        glfwGetCursorPos(window,&lgx,&lgy);
+ {
+   lgx=mouse_x;
+   lgy=mouse_y;
+ }
+}
+
+/* Input pipeline : the GLFW callbacks only stamp each event with the time it arrived and append it to a
+   lock-free single producer, single consumer ring. The main loop plays the queued events just before its
+   ticks, so the game sees them in order with the time they happened, and the wait for the next frame
+   ends as soon as a key or button comes in instead of at the next frame slot. Cursor motion goes into
+   cursorx and cursory, which the render thread latches for the helicopter camera right before it draws
+   (see latchinput), and takes at most one slot of the ring however fast the mouse reports */
+enum { INPUT_KEY, INPUT_BUTTON, INPUT_MOTION };
+struct InputEvent {
+  int type;
+  int code,action;          // key or mouse button, GLFW_PRESS or GLFW_RELEASE
+  double x,y;               // cursor position
+  double time;              // when the event arrived
+};
+#define INPUT_QUEUE 256
+InputEvent inputqueue[INPUT_QUEUE];
+atomic<unsigned> inputhead(0),inputtail(0);  // next event to play, next free slot
+atomic<double> cursorx(0),cursory(0);         // newest cursor position
+long queuedpresses=0,playedpresses=0;         // keys and buttons queued and played so far
+long inputdropped=0;
+bool motionqueued=false;                      // a motion event waits in the ring, it plays the newest position
+double inputtime=0;                           // when the oldest key or button played but not yet shown came in
+double publishedgametime=-1;                  // game time of the last snapshot
+double inputlatency=0;                        // from the arrival of keys and buttons to the swap that showed them
+long inputsamples=0;
+
+/* Append an event to the ring, false if it was full */
+bool queueinput(int type,int code,int action)
+{
+  unsigned tail=inputtail.load(memory_order_relaxed);
+  if(tail-inputhead.load(memory_order_acquire)>=INPUT_QUEUE)
+  {
+    inputdropped++;
+    return false;
+  }
+  if(type!=INPUT_MOTION)
+  redraw=true;
+  InputEvent &e=inputqueue[tail%INPUT_QUEUE];
+  e.type=type;
+  e.code=code;
+  e.action=action;
+  e.x=cursorx.load(memory_order_relaxed);
+  e.y=cursory.load(memory_order_relaxed);
+  e.time=glfwGetTime();
+  inputtail.store(tail+1,memory_order_release);
+  if(type!=INPUT_MOTION)
+  queuedpresses++;
+  return true;
+}
+/* Executed when a regular key is pressed/released/held-down */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+  queueinput(INPUT_KEY,key,action);
+}
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+  queueinput(INPUT_BUTTON,button,action);
+}
+/* Executed when the cursor moves over the window */
+void cursorMotion (GLFWwindow* window, double x, double y)
+{
+  cursorx.store(x,memory_order_relaxed);
+  cursory.store(y,memory_order_relaxed);
+  if(!motionqueued)
+  motionqueued=queueinput(INPUT_MOTION,0,0);
+}
+/* Play the events queued since the last call */
+void playinput()
+{
+  unsigned head=inputhead.load(memory_order_relaxed);
+  while(head!=inputtail.load(memory_order_acquire))
+  {
+    InputEvent e=inputqueue[head%INPUT_QUEUE];
+    inputhead.store(++head,memory_order_release);
+    if(e.type==INPUT_MOTION)
+    {
+      motionqueued=false;
+      mouse_x=cursorx.load(memory_order_relaxed);
+      mouse_y=cursory.load(memory_order_relaxed);
+      continue;
+    }
+    mouse_x=e.x;
+    mouse_y=e.y;
+    if(e.type==INPUT_KEY)
+    playkey(e.code,e.action,e.time);
+    else
+    playbutton(e.code,e.action);
+    playedpresses++;
+    if(inputtime==0 || e.time<inputtime)
+    inputtime=e.time;
+  }
+}
+
+/* Cameras : one per value of view, each caching its view and projection. A camera remembers the
+   input it was built from (block position, helicopter angle, framebuffer aspect) and is only
+   rebuilt when that input changes */
+struct Camera {
+  bool perspective;
+  bool built;
+  glm::vec4 anchor;        // what the view was built from
+  float aspect;            // what the projection was built for
+  int version;             // bumped on every rebuild
+  glm::mat4 view,projection;
+  glm::vec4 planes[6];     // frustum of projection*view, normals pointing inwards
+} cameras[VIEWS];
+float camera_rotation_angle = 90;
+/* Width over height of the framebuffer, set by the render thread from the snapshots */
+float aspect=1;
+
+/* Angle of the helicopter camera as the render thread latched it */
+float shownangle=90;
+/* Input a camera's view depends on, the cameras that do not move have a constant one */
+glm::vec4 cameraanchor(int v)
+{
+  if(v==VIEW_HELICOPTER)
+  return glm::vec4(shownangle,0,0,0);
+  if(v==VIEW_BLOCK || v==VIEW_FOLLOW)
+  return glm::vec4(shown->block.x2,shown->block.y2,shown->block.z2,0);
+  return glm::vec4(0);
+}
+/* Bring a camera up to date and return it */
+Camera &updatecamera(int v)
+{
+  Camera &camera=cameras[v];
+  glm::vec4 anchor=cameraanchor(v);
+  int version=camera.version;
+  if(!camera.built || anchor!=camera.anchor)
+  {
+    if(v==VIEW_TOWER)
+    camera.view = glm::lookAt(glm::vec3(-20,-20,15), glm::vec3(0,0,0), glm::vec3(1,1,8/3));
+    else if(v==VIEW_TOP)
+    camera.view = glm::lookAt(glm::vec3(0,0,15), glm::vec3(0,0,0), glm::vec3(0,1,0));
+    else if(v==VIEW_BACK)
+    camera.view = glm::lookAt(glm::vec3(20,20,15), glm::vec3(0,0,0), glm::vec3(1,1,8/3));
+    else if(v==VIEW_HELICOPTER)
+    camera.view = glm::lookAt(glm::vec3(-20*cos(shownangle*M_PI/180),-20*sin(shownangle*M_PI/180),15), glm::vec3(0,0,0), glm::vec3(1,1,8/3));
+    else if(v==VIEW_BLOCK)
+    camera.view = glm::lookAt(glm::vec3(shown->block.x2+1,shown->block.y2,shown->block.z2+1), glm::vec3(shown->block.x2+3,shown->block.y2,shown->block.z2), glm::vec3(0,0,1));
+    else
+    camera.view = glm::lookAt(glm::vec3(shown->block.x2-6,shown->block.y2,shown->block.z2+5), glm::vec3(shown->block.x2+3,shown->block.y2,shown->block.z2+2), glm::vec3(0,0,1));
+    camera.anchor=anchor;
+    camera.version++;
+  }
+  if(!camera.built || aspect!=camera.aspect)
+  {
+    camera.perspective=(v==VIEW_BLOCK || v==VIEW_FOLLOW);
+    if(camera.perspective)
+    camera.projection = glm::perspective (90.0f, aspect, 0.1f, 500.0f);
+    // The ortho views keep the whole 40x40 square visible and widen the longer side
+    else if(aspect>=1)
+    camera.projection = glm::ortho(-20.0f*aspect, 20.0f*aspect, -20.0f, 20.0f, 0.1f, 500.0f);
+    else
+    camera.projection = glm::ortho(-20.0f, 20.0f, -20.0f/aspect, 20.0f/aspect, 0.1f, 500.0f);
+    camera.aspect=aspect;
+    camera.version++;
+  }
+  if(!camera.built || camera.version!=version)
+  {
+    // Gribb/Hartmann: each plane is the last row of the matrix plus or minus one of the others
+    glm::mat4 m=camera.projection*camera.view;
+    int k;
+    for(k=0;k<3;k++)
+    {
+      glm::vec4 row(m[0][k],m[1][k],m[2][k],m[3][k]),w(m[0][3],m[1][3],m[2][3],m[3][3]);
+      camera.planes[2*k]=w+row;
+      camera.planes[2*k+1]=w-row;
+    }
+  }
+  camera.built=true;
+  return camera;
+}
+/* False when the box lies wholly on the outer side of one of the camera's frustum planes */
+bool boxinfrustum(const Camera &camera,glm::vec3 lo,glm::vec3 hi)
+{
+  int k;
+  for(k=0;k<6;k++)
+  {
+    glm::vec4 p=camera.planes[k];
+    glm::vec3 corner(p.x>=0?hi.x:lo.x,p.y>=0?hi.y:lo.y,p.z>=0?hi.z:lo.z);
+    if(glm::dot(glm::vec3(p),corner)+p.w<0)
+    return false;
+  }
+  return true;
 }
 
 /* Executed when window is resized to 'width' and 'height' */
@@ -547,11 +1105,19 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
     glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    redraw=true;
+    // the cursor comes in screen coordinates, which the framebuffer size is not on Retina
+    int winwidth,winheight;
+    glfwGetWindowSize(window, &winwidth, &winheight);
+    if(winwidth>0 && winheight>0)
+    {
+      screenwidth=winwidth;
+      screenheight=winheight;
+    }
 
 	GLfloat fov = 90.0f;
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	// The render thread sets the viewport when a snapshot brings the new size
 
 	// set the projection matrix as perspective
 	/* glMatrixMode (GL_PROJECTION);
@@ -563,36 +1129,17 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     //  Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
 		//  else
     // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-20.0f, 20.0f, -20.0f, 20.0f,  0.1f, 500.0f);
+    // The cameras rebuild their projections for the new aspect when they are next used
+    if(fbwidth>0 && fbheight>0)
+    {
+      windowwidth=fbwidth;
+      windowheight=fbheight;
+    }
 }
 
-VAO *tile,*brick[2],*circle,*rect[2],*triangle,*triangle1,*triangle2,*triangle3;
-// Creates the triangle object used in this sample code
-
-void createTriangle ()
-{
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
-
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
-    0, 1,0, // vertex 0
-    -1,-1,0, // vertex 1
-    1,-1,0, // vertex 2
-  };
-
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
-
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
-	triangle1 = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
-	triangle2 = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
-	triangle3 = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
-}
-void createtile(float length,float width,float height,int block,float c1,float c2,float c3,float c4,float c5,float c6,int num)
+VAO *tile,*brick[2],*circle,*rect[2];
+/* Fill the 36 vertices and colours of a box, as drawn by createtile */
+void filltile(float length,float width,float height,float c1,float c2,float c3,float c4,float c5,float c6,int num,GLfloat *vertex_out,GLfloat *color_buffer_data)
 {
   GLfloat vertex_buffer_data[]=
   {
@@ -645,7 +1192,6 @@ void createtile(float length,float width,float height,int block,float c1,float c
     -length,width,-height,
     -length,-width,-height
   };
-  GLfloat color_buffer_data[120];
   int i;
   int left[100]={0,1,5,12,13,17,24,29,30,35,7,8,9,14,15,16,28,34};
   //if(block==0)
@@ -672,23 +1218,628 @@ void createtile(float length,float width,float height,int block,float c1,float c
      color_buffer_data[3*i+2]=c3;
   }
   }
+  memcpy(vertex_out,vertex_buffer_data,sizeof(vertex_buffer_data));
+}
+void createtile(float length,float width,float height,int block,float c1,float c2,float c3,float c4,float c5,float c6,int num)
+{
+  GLfloat vertex_buffer_data[108],color_buffer_data[108];
+  filltile(length,width,height,c1,c2,c3,c4,c5,c6,num,vertex_buffer_data,color_buffer_data);
   if(block==0)
   tile = create3DObject(GL_TRIANGLES,36, vertex_buffer_data, color_buffer_data, GL_FILL);
   else
-  brick[num]=create3DObject(GL_TRIANGLES,36, vertex_buffer_data, color_buffer_data, GL_FILL);
+  brick[num]=create3DObject(GL_TRIANGLES,36, vertex_buffer_data, color_buffer_data, GL_FILL, GL_HALF_FLOAT);
 }
-void createcircle(float r,float R,float G,float B,float x,float y)
+/* Build the tile meshes once so that draw() only binds and draws them */
+void createtilecache()
 {
-  GLfloat vertex_buffer_data[5*9*360],color_buffer_data[5*9*360];
-  int i;
-  for(i=0;i<5*360;i++)
+  int k;
+  for(k=0;k<TILE_KINDS;k++)
   {
-    vertex_buffer_data[9*i]=x+r*cos((float)i/5*M_PI/180.0);
-    vertex_buffer_data[9*i+1]=y+r*sin((float)i/5*M_PI/180.0);
-    vertex_buffer_data[9*i+2]=0;
-    vertex_buffer_data[9*i+3]=x+r*cos(((float)i/5+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+4]=y+r*sin(((float)i/5+1)*M_PI/180.0);
-    vertex_buffer_data[9*i+5]=0;
+    GLfloat *c=&tilepalette[k][0][0];
+    createtile(1,1,0.2,0,c[0],c[1],c[2],c[3],c[4],c[5],-1);
+    tilecache[k]=tile;
+  }
+}
+int tilekind(int i,int j)
+{
+  if(shown->level==4 && i==5 && j==5)
+  return TILE_SPLIT;
+  if(showncell(i,j)==1)
+  return TILE_NORMAL;
+  return TILE_FRAGILE;
+}
+/* What the baked board has to show in a cell : 0 if empty, tile kind + 1 otherwise */
+int cellcode(int i,int j)
+{
+  if(showncell(i,j)==0)
+  return 0;
+  return tilekind(i,j)+1;
+}
+void queuetile(int i,int j)
+{
+  if(i<BOARD_SIZE && j<BOARD_SIZE && !tilequeued[i][j])
+  {
+    tilequeued[i][j]=1;
+    dirtytiles.push_back(i*BOARD_SIZE+j);
+  }
+}
+void freechunk(int c)
+{
+  BoardChunk &chunk=chunks[c];
+  deletevertexarray(chunk.vao);
+  glDeleteBuffers(1,&chunk.buffer);
+  chunk.vao=chunk.buffer=0;
+}
+/* Drop every chunk and size the table for the current board */
+void resetchunks()
+{
+  size_t k;
+  for(k=0;k<residentchunks.size();k++)
+  freechunk(residentchunks[k]);
+  residentchunks.clear();
+  chunkrows=(shownboard->rows+BOARD_CHUNK-1)/BOARD_CHUNK;
+  chunkcols=(shownboard->cols+BOARD_CHUNK-1)/BOARD_CHUNK;
+  BoardChunk empty={0,0,0,0,-1,0};
+  chunks.assign(chunkrows*chunkcols,empty);
+}
+/* Change a cell of the render thread's board, marking the board for re-upload if it differs */
+void showcell(int i,int j,int v)
+{
+  if(showncell(i,j)!=v)
+  {
+    showncells[shownboard->index(i,j)]=v;
+    boardversion++;
+    queuetile(i,j);
+    // a tile on a chunk border shows in the side faces of the neighbouring chunk too
+    int r,c;
+    for(r=(i>0?i-1:0)/BOARD_CHUNK;r<=(i+1)/BOARD_CHUNK && r<chunkrows;r++)
+    for(c=(j>0?j-1:0)/BOARD_CHUNK;c<=(j+1)/BOARD_CHUNK && c<chunkcols;c++)
+    chunks[r*chunkcols+c].stamp=++chunkstamp;
+  }
+}
+/* Called once the board of a new level is in shownboard : queue only the cells that differ from a GPU copy */
+void boardloaded()
+{
+  int i,j;
+  boardversion++;
+  resetchunks();
+  for(i=0;i<BOARD_SIZE;i++)
+  for(j=0;j<BOARD_SIZE;j++)
+  if(cellcode(i,j)!=bakedcell[i][j] || cellcode(i,j)!=texturedcell[i][j])
+  queuetile(i,j);
+}
+
+void cleardirtytiles()
+{
+  int k;
+  for(k=0;k<(int)dirtytiles.size();k++)
+  tilequeued[dirtytiles[k]/BOARD_SIZE][dirtytiles[k]%BOARD_SIZE]=0;
+  dirtytiles.clear();
+}
+
+/* Rectangle of board cells the camera can see, rows r0..r1 and columns c0..c1 (empty when r0>r1),
+   out of the rows x cols cells the board renderer covers */
+struct VisibleCells {
+  int r0,r1,c0,c1;
+  int view,cameraversion,length,width,rows,cols;   // what the rectangle was worked out for
+  float z;
+  int version;                           // bumped whenever the rectangle changes
+} visiblecells={0,BOARD_SIZE-1,0,BOARD_SIZE-1,-1,-1,-1,-1,-1,-1,0,0};
+
+/* Bounding box of the tiles of rows i0..i1 and columns j0..j1 tested against the camera */
+bool cellsinfrustum(const Camera &camera,int i0,int i1,int j0,int j1)
+{
+  return boxinfrustum(camera,glm::vec3(2*j0-shown->board_length-3,-2*i1+shown->board_width-3,-0.2-zshift),
+                             glm::vec3(2*j1-shown->board_length-1,-2*i0+shown->board_width-1,0.2-zshift));
+}
+/* Trim whole columns, then whole rows of the remaining columns, then columns again against those rows.
+   Each test is one box per row or column, so this costs O(rows+cols) and only reruns when the camera or the board moved.
+   The ortho views see all of a BOARD_SIZE board, on a generated one they see a small window of it */
+void updatevisiblecells(const Camera &camera,int rows,int cols)
+{
+  VisibleCells &vis=visiblecells;
+  if(vis.view==shown->view && vis.cameraversion==camera.version && vis.length==shown->board_length && vis.width==shown->board_width && vis.z==zshift && vis.rows==rows && vis.cols==cols)
+  return;
+  vis.view=shown->view;
+  vis.cameraversion=camera.version;
+  vis.length=shown->board_length;
+  vis.width=shown->board_width;
+  vis.z=zshift;
+  vis.rows=rows;
+  vis.cols=cols;
+  int r0=0,r1=rows-1,c0=0,c1=cols-1;
+  while(c0<=c1 && !cellsinfrustum(camera,r0,r1,c0,c0)) c0++;
+  while(c1>=c0 && !cellsinfrustum(camera,r0,r1,c1,c1)) c1--;
+  while(c0<=c1 && r0<=r1 && !cellsinfrustum(camera,r0,r0,c0,c1)) r0++;
+  while(c0<=c1 && r1>=r0 && !cellsinfrustum(camera,r1,r1,c0,c1)) r1--;
+  while(r0<=r1 && c0<=c1 && !cellsinfrustum(camera,r0,r1,c0,c0)) c0++;
+  while(r0<=r1 && c1>=c0 && !cellsinfrustum(camera,r0,r1,c1,c1)) c1--;
+  if(c0>c1 || r0>r1)
+  {
+    r0=0;
+    r1=-1;
+    c0=0;
+    c1=-1;
+  }
+  if(r0!=vis.r0 || r1!=vis.r1 || c0!=vis.c0 || c1!=vis.c1)
+  {
+    vis.r0=r0;
+    vis.r1=r1;
+    vis.c0=c0;
+    vis.c1=c1;
+    vis.version++;
+  }
+}
+/* Append vertices first..first+n-1 to a multi-draw, growing the last range when the two touch */
+void addrange(vector<GLint> &firsts,vector<GLsizei> &counts,GLint first,GLsizei n)
+{
+  if(n<=0)
+  return;
+  if(!firsts.empty() && firsts.back()+counts.back()==first)
+  counts.back()+=n;
+  else
+  {
+    firsts.push_back(first);
+    counts.push_back(n);
+  }
+}
+
+void createbakedboard()
+{
+  glGenVertexArrays(1,&BakedArrayID);
+  glGenBuffers(1,&BakedBuffer);
+  bindvertexarray(BakedArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER,BakedBuffer);
+  glBufferData(GL_ARRAY_BUFFER,BOARD_SIZE*BOARD_SIZE*36*6*sizeof(GLfloat),NULL,GL_DYNAMIC_DRAW);
+  glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,6*sizeof(GLfloat),(void*)0);
+  glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,6*sizeof(GLfloat),(void*)(3*sizeof(GLfloat)));
+  enableattrib(0);
+  enableattrib(1);
+}
+/* Write the 36 interleaved vertices of cell (i,j) into its slot, degenerate if the cell is empty */
+void bakecell(int i,int j,GLfloat *slot)
+{
+  int code=cellcode(i,j),k;
+  bakedcell[i][j]=code;
+  if(code==0)
+  {
+    memset(slot,0,36*6*sizeof(GLfloat));
+    return;
+  }
+  GLfloat vertex_buffer_data[108],color_buffer_data[108],*c=&tilepalette[code-1][0][0];
+  filltile(1,1,0.2,c[0],c[1],c[2],c[3],c[4],c[5],-1,vertex_buffer_data,color_buffer_data);
+  for(k=0;k<36;k++)
+  {
+    slot[6*k]=vertex_buffer_data[3*k]+2*j-(int)shown->board_length-2;
+    slot[6*k+1]=vertex_buffer_data[3*k+1]-2*i+(int)shown->board_width-2;
+    slot[6*k+2]=vertex_buffer_data[3*k+2];
+    slot[6*k+3]=color_buffer_data[3*k];
+    slot[6*k+4]=color_buffer_data[3*k+1];
+    slot[6*k+5]=color_buffer_data[3*k+2];
+  }
+}
+/* Bring the baked buffer up to date: a full bake when the board origin moved, else only the dirty slots */
+void updatebakedboard()
+{
+  int i,j,k;
+  glBindBuffer(GL_ARRAY_BUFFER,BakedBuffer);
+  if(bakedlength!=shown->board_length || bakedwidth!=shown->board_width)
+  {
+    vector<GLfloat> data(BOARD_SIZE*BOARD_SIZE*36*6);
+    bakedlength=shown->board_length;
+    bakedwidth=shown->board_width;
+    for(i=0;i<BOARD_SIZE;i++)
+    for(j=0;j<BOARD_SIZE;j++)
+    {
+      bakedcell[i][j]=0;
+      bakecell(i,j,&data[(i*BOARD_SIZE+j)*36*6]);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER,0,data.size()*sizeof(GLfloat),&data[0]);
+  }
+  else
+  {
+    GLfloat slot[36*6];
+    for(k=0;k<(int)dirtytiles.size();k++)
+    {
+      i=dirtytiles[k]/BOARD_SIZE;
+      j=dirtytiles[k]%BOARD_SIZE;
+      if(cellcode(i,j)==bakedcell[i][j])
+      continue;
+      bakecell(i,j,slot);
+      glBufferSubData(GL_ARRAY_BUFFER,(i*BOARD_SIZE+j)*sizeof(slot),sizeof(slot),slot);
+    }
+  }
+  cleardirtytiles();
+}
+
+/* VAO for the instanced board: the tile cube plus a per-instance (offset x, offset y, kind) buffer */
+void createboardinstances()
+{
+  glGenVertexArrays(1,&BoardArrayID);
+  glGenBuffers(1,&TileInstanceBuffer);
+  bindvertexarray(BoardArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER,tilecache[TILE_NORMAL]->VertexBuffer);
+  glVertexAttribPointer(0,3,tilecache[TILE_NORMAL]->PositionType,GL_FALSE,tilecache[TILE_NORMAL]->Stride,(void*)0);
+  enableattrib(0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,tilecache[TILE_NORMAL]->IndexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER,TileInstanceBuffer);
+  glVertexAttribPointer(2,2,GL_FLOAT,GL_FALSE,3*sizeof(GLfloat),(void*)0);
+  glVertexAttribPointer(3,1,GL_FLOAT,GL_FALSE,3*sizeof(GLfloat),(void*)(2*sizeof(GLfloat)));
+  glVertexAttribDivisor(2,1);
+  glVertexAttribDivisor(3,1);
+  enableattrib(2);
+  enableattrib(3);
+}
+/* Re-upload the instance buffer with the visible tiles, only needed after the board or the visible cells changed */
+void updateboardinstances()
+{
+  vector<GLfloat> inst;
+  int i,j;
+  for(i=visiblecells.r0;i<=visiblecells.r1;i++)
+  {
+    for(j=visiblecells.c0;j<=visiblecells.c1;j++)
+    {
+      if(showncell(i,j)!=0)
+      {
+        inst.push_back(2*j-(int)shown->board_length-2);
+        inst.push_back(-2*i+(int)shown->board_width-2);
+        inst.push_back(tilekind(i,j));
+      }
+    }
+  }
+  num_tile_instances=inst.size()/3;
+  glBindBuffer(GL_ARRAY_BUFFER,TileInstanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER,inst.size()*sizeof(GLfloat),inst.empty()?NULL:&inst[0],GL_DYNAMIC_DRAW);
+  instancedversion=boardversion;
+  instancedvisible=visiblecells.version;
+}
+/* Vertex layout of a greedy meshed buffer, bound to the VAO : position, tile-local u,v and tile kind */
+void meshedlayout(GLuint vao,GLuint buffer)
+{
+  bindvertexarray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER,buffer);
+  glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,6*sizeof(GLfloat),(void*)0);
+  glVertexAttribPointer(4,2,GL_FLOAT,GL_FALSE,6*sizeof(GLfloat),(void*)(3*sizeof(GLfloat)));
+  glVertexAttribPointer(3,1,GL_FLOAT,GL_FALSE,6*sizeof(GLfloat),(void*)(5*sizeof(GLfloat)));
+  enableattrib(0);
+  enableattrib(3);
+  enableattrib(4);
+}
+void createmeshedboard()
+{
+  glGenVertexArrays(1,&MeshedArrayID);
+  glGenBuffers(1,&MeshedBuffer);
+  meshedlayout(MeshedArrayID,MeshedBuffer);
+}
+/* Cell kind for meshing : -1 if there is no tile */
+int meshcell(int i,int j)
+{
+  if(i<0 || j<0 || i>=shownboard->rows || j>=shownboard->cols || showncell(i,j)==0)
+  return -1;
+  return tilekind(i,j);
+}
+/* Emit one quad (two triangles) of the face of the tile region rows r0..r1, cols c0..c1.
+   Corners p and q are opposite corners of the face, the tile-local u,v are measured from the region's min corner */
+void meshquad(vector<GLfloat> &mesh,int r0,int r1,int c0,int c1,int kind,glm::vec3 p,glm::vec3 q)
+{
+  float minx=2*c0-(int)shown->board_length-3,miny=-2*r1+(int)shown->board_width-3;
+  glm::vec3 corner[4];
+  int k,order[6]={0,1,2,2,3,0};
+  corner[0]=p;
+  corner[2]=q;
+  if(p.z==q.z)
+  {
+    corner[1]=glm::vec3(q.x,p.y,p.z);
+    corner[3]=glm::vec3(p.x,q.y,p.z);
+  }
+  else
+  {
+    corner[1]=glm::vec3(q.x,q.y,p.z);
+    corner[3]=glm::vec3(p.x,p.y,q.z);
+  }
+  for(k=0;k<6;k++)
+  {
+    glm::vec3 v=corner[order[k]];
+    mesh.push_back(v.x);
+    mesh.push_back(v.y);
+    mesh.push_back(v.z);
+    mesh.push_back(v.x-minx);
+    mesh.push_back(v.y-miny);
+    mesh.push_back(kind);
+  }
+}
+/* Greedy mesher for the cells of rows i0..i1-1 and columns j0..j1-1 : merge same-kind rectangles of tiles
+   into one top and one bottom quad, and emit side faces only where the neighbouring cell is empty, merged along runs.
+   Nothing is merged across the edges of the block of cells */
+void meshcells(vector<GLfloat> &mesh,int i0,int i1,int j0,int j1)
+{
+  vector<char> used((i1-i0)*(j1-j0),0);
+  int i,j,k,w,h,d;
+  float L=(int)shown->board_length,W=(int)shown->board_width;
+#define USED(i,j) used[((i)-i0)*(j1-j0)+(j)-j0]
+  for(i=i0;i<i1;i++)
+  {
+    for(j=j0;j<j1;j++)
+    {
+      k=meshcell(i,j);
+      if(k<0 || USED(i,j))
+      continue;
+      for(w=1;j+w<j1 && !USED(i,j+w) && meshcell(i,j+w)==k;w++);
+      for(h=1;i+h<i1;h++)
+      {
+        for(d=0;d<w;d++)
+        if(USED(i+h,j+d) || meshcell(i+h,j+d)!=k)
+        break;
+        if(d<w)
+        break;
+      }
+      for(d=0;d<h*w;d++)
+      USED(i+d/w,j+d%w)=1;
+      float x0=2*j-L-3,x1=2*(j+w-1)-L-1,y0=-2*(i+h-1)+W-3,y1=-2*i+W-1;
+      meshquad(mesh,i,i+h-1,j,j+w-1,k,glm::vec3(x0,y0,0.2),glm::vec3(x1,y1,0.2));
+      meshquad(mesh,i,i+h-1,j,j+w-1,k,glm::vec3(x0,y0,-0.2),glm::vec3(x1,y1,-0.2));
+    }
+  }
+#undef USED
+  /* West and east faces run down a column, north and south faces along a row */
+  for(d=0;d<4;d++)
+  {
+    int di=(d==2)?-1:(d==3)?1:0,dj=(d==0)?-1:(d==1)?1:0;
+    for(i=i0;i<i1;i++)
+    {
+      for(j=j0;j<j1;j++)
+      {
+        k=meshcell(i,j);
+        if(k<0 || meshcell(i+di,j+dj)>=0 || (dj!=0 && i>i0 && meshcell(i-1,j)==k && meshcell(i-1+di,j+dj)<0) || (di!=0 && j>j0 && meshcell(i,j-1)==k && meshcell(i+di,j-1)<0))
+        continue;
+        int n=1;
+        if(dj!=0)
+        while(i+n<i1 && meshcell(i+n,j)==k && meshcell(i+n+di,j+dj)<0) n++;
+        else
+        while(j+n<j1 && meshcell(i,j+n)==k && meshcell(i+di,j+n+dj)<0) n++;
+        int r1=(dj!=0)?i+n-1:i,c1=(dj!=0)?j:j+n-1;
+        float x0=2*j-L-3,x1=2*c1-L-1,y0=-2*r1+W-3,y1=-2*i+W-1;
+        if(d==0) x1=x0;
+        if(d==1) x0=x1;
+        if(d==2) y0=y1;
+        if(d==3) y1=y0;
+        meshquad(mesh,i,r1,j,c1,k,glm::vec3(x0,y0,-0.2),glm::vec3(x1,y1,0.2));
+      }
+    }
+  }
+}
+/* The meshed board : its chunks written one after the other */
+void updatemeshedboard()
+{
+  vector<GLfloat> mesh;
+  int c;
+  for(c=0;c<MESH_CHUNKS*MESH_CHUNKS;c++)
+  {
+    int i0=c/MESH_CHUNKS*MESH_CHUNK,j0=c%MESH_CHUNKS*MESH_CHUNK;
+    meshchunkfirst[c]=mesh.size()/6;
+    meshcells(mesh,i0,(i0+MESH_CHUNK<BOARD_SIZE)?i0+MESH_CHUNK:BOARD_SIZE,j0,(j0+MESH_CHUNK<BOARD_SIZE)?j0+MESH_CHUNK:BOARD_SIZE);
+    meshchunkcount[c]=mesh.size()/6-meshchunkfirst[c];
+  }
+  glBindBuffer(GL_ARRAY_BUFFER,MeshedBuffer);
+  glBufferData(GL_ARRAY_BUFFER,mesh.size()*sizeof(GLfloat),mesh.empty()?NULL:&mesh[0],GL_STATIC_DRAW);
+  meshedversion=boardversion;
+}
+/* Mesh chunk c into its buffer, making it resident first if needed */
+void buildchunk(int c)
+{
+  BoardChunk &chunk=chunks[c];
+  vector<GLfloat> mesh;
+  int i0=c/chunkcols*BOARD_CHUNK,j0=c%chunkcols*BOARD_CHUNK;
+  if(chunk.vao==0)
+  {
+    glGenVertexArrays(1,&chunk.vao);
+    glGenBuffers(1,&chunk.buffer);
+    meshedlayout(chunk.vao,chunk.buffer);
+    residentchunks.push_back(c);
+  }
+  meshcells(mesh,i0,(i0+BOARD_CHUNK<shownboard->rows)?i0+BOARD_CHUNK:shownboard->rows,j0,(j0+BOARD_CHUNK<shownboard->cols)?j0+BOARD_CHUNK:shownboard->cols);
+  glBindBuffer(GL_ARRAY_BUFFER,chunk.buffer);
+  glBufferData(GL_ARRAY_BUFFER,mesh.size()*sizeof(GLfloat),mesh.empty()?NULL:&mesh[0],GL_STATIC_DRAW);
+  chunk.vertices=mesh.size()/6;
+  chunk.built=chunk.stamp;
+}
+/* Free the chunks unseen for CHUNK_KEEP frames, then the least recently seen ones while over CHUNK_BUDGET */
+void evictchunks()
+{
+  size_t k;
+  for(k=0;k<residentchunks.size();)
+  {
+    if(chunkframe-chunks[residentchunks[k]].lastseen>CHUNK_KEEP)
+    {
+      freechunk(residentchunks[k]);
+      residentchunks[k]=residentchunks.back();
+      residentchunks.pop_back();
+    }
+    else
+    k++;
+  }
+  while(residentchunks.size()>CHUNK_BUDGET)
+  {
+    size_t oldest=0;
+    for(k=1;k<residentchunks.size();k++)
+    if(chunks[residentchunks[k]].lastseen<chunks[residentchunks[oldest]].lastseen)
+    oldest=k;
+    if(chunks[residentchunks[oldest]].lastseen==chunkframe)
+    break;
+    freechunk(residentchunks[oldest]);
+    residentchunks[oldest]=residentchunks.back();
+    residentchunks.pop_back();
+  }
+}
+/* Draw the chunks that overlap the visible cells and pass the frustum test. Missing or stale chunks
+   are built on the way, at most CHUNK_BUILDS_PER_FRAME of them so that walking into new ground never stalls a frame */
+void drawchunks()
+{
+  VisibleCells &vis=visiblecells;
+  Camera &camera=cameras[shown->view];
+  int r,c,builds=0;
+  chunkframe++;
+  Matrices.model = glm::translate (glm::vec3(0,0,-zshift));
+  glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+  glUniform1i(Matrices.DrawModeID, DRAW_TILE_MESHED);
+  setpolygonmode (GL_FILL);
+  for(r=vis.r0/BOARD_CHUNK;r<=vis.r1/BOARD_CHUNK;r++)
+  {
+    for(c=vis.c0/BOARD_CHUNK;c<=vis.c1/BOARD_CHUNK;c++)
+    {
+      int i0=r*BOARD_CHUNK,j0=c*BOARD_CHUNK;
+      int i1=(i0+BOARD_CHUNK<shownboard->rows)?i0+BOARD_CHUNK-1:shownboard->rows-1,j1=(j0+BOARD_CHUNK<shownboard->cols)?j0+BOARD_CHUNK-1:shownboard->cols-1;
+      if(!cellsinfrustum(camera,i0,i1,j0,j1))
+      continue;
+      BoardChunk &chunk=chunks[r*chunkcols+c];
+      chunk.lastseen=chunkframe;
+      if((chunk.vao==0 || chunk.built!=chunk.stamp) && builds<CHUNK_BUILDS_PER_FRAME)
+      {
+        buildchunk(r*chunkcols+c);
+        builds++;
+      }
+      if(chunk.vao==0 || chunk.vertices==0)
+      continue;
+      bindvertexarray (chunk.vao);
+      glDrawArrays(GL_TRIANGLES, 0, chunk.vertices);
+    }
+  }
+  glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+  evictchunks();
+}
+void createtextureboard()
+{
+  glGenVertexArrays(1,&EmptyArrayID);
+  glGenTextures(1,&BoardTexture);
+  glBindTexture(GL_TEXTURE_2D,BoardTexture);
+  glTexImage2D(GL_TEXTURE_2D,0,GL_R8UI,BOARD_SIZE,BOARD_SIZE,0,GL_RED_INTEGER,GL_UNSIGNED_BYTE,NULL);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+}
+/* One texture upload for a new level, a single texel per changed tile otherwise */
+void updatetextureboard()
+{
+  int i,j,k;
+  unsigned char code;
+  glBindTexture(GL_TEXTURE_2D,BoardTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+  if(texturedlength!=shown->board_length || texturedwidth!=shown->board_width)
+  {
+    unsigned char cells[BOARD_SIZE*BOARD_SIZE];
+    for(i=0;i<BOARD_SIZE;i++)
+    for(j=0;j<BOARD_SIZE;j++)
+    cells[i*BOARD_SIZE+j]=texturedcell[i][j]=cellcode(i,j);
+    glTexSubImage2D(GL_TEXTURE_2D,0,0,0,BOARD_SIZE,BOARD_SIZE,GL_RED_INTEGER,GL_UNSIGNED_BYTE,cells);
+    texturedlength=shown->board_length;
+    texturedwidth=shown->board_width;
+  }
+  else
+  {
+    for(k=0;k<(int)dirtytiles.size();k++)
+    {
+      i=dirtytiles[k]/BOARD_SIZE;
+      j=dirtytiles[k]%BOARD_SIZE;
+      code=texturedcell[i][j]=cellcode(i,j);
+      glTexSubImage2D(GL_TEXTURE_2D,0,j,i,1,1,GL_RED_INTEGER,GL_UNSIGNED_BYTE,&code);
+    }
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+  cleardirtytiles();
+}
+/* Draw the board with one of the single call renderers, BOARD_TILES goes through submitboardtiles.
+   Each renderer only draws the cells of visiblecells */
+void drawboard()
+{
+  VisibleCells &vis=visiblecells;
+  vector<GLint> firsts;
+  vector<GLsizei> counts;
+  int i;
+  if(vis.r0>vis.r1)
+  return;
+  if(boardmode==BOARD_CHUNKED)
+  {
+    drawchunks();
+    return;
+  }
+  if(boardmode==BOARD_TEXTURE)
+  {
+    if(!dirtytiles.empty() || texturedlength!=shown->board_length || texturedwidth!=shown->board_width)
+    updatetextureboard();
+    Matrices.model = glm::translate (glm::vec3(0,0,-zshift));
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+    glUniform1i(Matrices.DrawModeID, DRAW_TILE_TEXTURE);
+    glUniform2f(Matrices.BoardOriginID, -(int)shown->board_length-2, (int)shown->board_width-2);
+    glUniform2i(Matrices.FirstCellID, vis.c0, vis.r0);
+    glUniform2i(Matrices.DrawnCellsID, vis.c1-vis.c0+1, vis.r1-vis.r0+1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, BoardTexture);
+    setpolygonmode (GL_FILL);
+    bindvertexarray (EmptyArrayID);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 36, (vis.c1-vis.c0+1)*(vis.r1-vis.r0+1));
+    glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+    return;
+  }
+  if(boardmode==BOARD_MESHED)
+  {
+    if(meshedversion!=boardversion)
+    updatemeshedboard();
+    Matrices.model = glm::translate (glm::vec3(0,0,-zshift));
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+    glUniform1i(Matrices.DrawModeID, DRAW_TILE_MESHED);
+    setpolygonmode (GL_FILL);
+    bindvertexarray (MeshedArrayID);
+    for(i=0;i<MESH_CHUNKS*MESH_CHUNKS;i++)
+    {
+      int i0=i/MESH_CHUNKS*MESH_CHUNK,j0=i%MESH_CHUNKS*MESH_CHUNK;
+      if(i0<=vis.r1 && i0+MESH_CHUNK>vis.r0 && j0<=vis.c1 && j0+MESH_CHUNK>vis.c0)
+      addrange(firsts,counts,meshchunkfirst[i],meshchunkcount[i]);
+    }
+    if(!firsts.empty())
+    glMultiDrawArrays(GL_TRIANGLES, &firsts[0], &counts[0], firsts.size());
+    glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+    return;
+  }
+  if(boardmode==BOARD_BAKED)
+  {
+    if(!dirtytiles.empty() || bakedlength!=shown->board_length || bakedwidth!=shown->board_width)
+    updatebakedboard();
+    Matrices.model = glm::translate (glm::vec3(0,0,-zshift));
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+    setpolygonmode (GL_FILL);
+    bindvertexarray (BakedArrayID);
+    // one range of slots per visible row, a single range when whole rows are visible
+    for(i=vis.r0;i<=vis.r1;i++)
+    addrange(firsts,counts,(i*BOARD_SIZE+vis.c0)*36,(vis.c1-vis.c0+1)*36);
+    glMultiDrawArrays(GL_TRIANGLES, &firsts[0], &counts[0], firsts.size());
+    return;
+  }
+  if(boardmode==BOARD_INSTANCED)
+  {
+    if(instancedversion!=boardversion || instancedvisible!=vis.version)
+    updateboardinstances();
+    Matrices.model = glm::translate (glm::vec3(0,0,-zshift));
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+    glUniform1i(Matrices.DrawModeID, DRAW_TILE_INSTANCED);
+    setpolygonmode (GL_FILL);
+    bindvertexarray (BoardArrayID);
+    glDrawElementsInstanced(GL_TRIANGLES, tilecache[TILE_NORMAL]->NumIndices, tilecache[TILE_NORMAL]->IndexType, (void*)0, num_tile_instances);
+    glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+  }
+}
+void createcircle(float r,float R,float G,float B,float x,float y)
+{
+  GLfloat vertex_buffer_data[5*9*360],color_buffer_data[5*9*360];
+  int i;
+  for(i=0;i<5*360;i++)
+  {
+    vertex_buffer_data[9*i]=x+r*cos((float)i/5*M_PI/180.0);
+    vertex_buffer_data[9*i+1]=y+r*sin((float)i/5*M_PI/180.0);
+    vertex_buffer_data[9*i+2]=0;
+    vertex_buffer_data[9*i+3]=x+r*cos(((float)i/5+1)*M_PI/180.0);
+    vertex_buffer_data[9*i+4]=y+r*sin(((float)i/5+1)*M_PI/180.0);
+    vertex_buffer_data[9*i+5]=0;
     vertex_buffer_data[9*i+6]=x;
     vertex_buffer_data[9*i+7]=y;
     vertex_buffer_data[9*i+8]=0;
@@ -699,7 +1850,7 @@ void createcircle(float r,float R,float G,float B,float x,float y)
     color_buffer_data[i+1]=G;
     color_buffer_data[i+2]=B;
   }
- circle = create3DObject(GL_TRIANGLES, 5*1080, vertex_buffer_data, color_buffer_data, GL_FILL);
+ circle = create3DObject(GL_TRIANGLES, 5*1080, vertex_buffer_data, color_buffer_data, GL_FILL, GL_HALF_FLOAT);
 }
 void createRectangle(float x1,float y1,float x2,float y2,float x3,float y3,float x4,float y4,float R,float G,float B,int i)
 {
@@ -727,262 +1878,813 @@ void createRectangle(float x1,float y1,float x2,float y2,float x3,float y3,float
   // create3DObject creates and returns a handle to a VAO that can be used later
   rect[i]= create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
   }
-float camera_rotation_angle = 90;
+/* Level 2 switch markers : the round switch and the cross on the bridge switch, built once */
+void createswitches()
+{
+  createcircle(1,0,0,0,-12,-2);
+  createRectangle(-1,0.8,-0.8,1,1,-0.8,0.8,-1,0,0,0,0);
+  createRectangle(-0.9,-1,1,0.9,0.9,1,-1,-0.9,0,0,0,1);
+}
 
 /* Render the scene with openGL */
 /* Edit this function according to your assignment */
 void rightkeypressed(float h1,float h2,float h3,float h4,float h5,float h6,float h7,float h8)
 {
-  if(block.x1==block.x2 && block.y1==block.y2)
+  if(block.x1==block.x2 && block.y1==block.y2)
+  {
+    block.x1+=h1;
+    block.x2+=h2;
+    block.z2+=h3;
+  }
+  else
+  {
+    if(block.x1==block.x2)
+    {
+      block.x1+=h4;
+      block.x2+=h5;
+    }
+    else
+    {
+      block.x1+=h6;
+      block.x2+=h7;
+      block.z2+=h8;
+    }
+  }
+  //cout<<(4-block.y1)/2<<" "<<(12+block.x1)/2<<" "<<(4-block.y2)/2<<" "<<(12+block.x2)/2<<endl;
+}
+/* Model matrices of the orientation table, filled once at start up */
+void createorientations()
+{
+  int o,r,c;
+  for(o=0;o<24;o++)
+  {
+    orientationmatrix[o]=glm::mat4(1.0f);
+    for(r=0;r<3;r++)
+    for(c=0;c<3;c++)
+    orientationmatrix[o][c][r]=orientationtable[o][r][c];
+  }
+}
+/* Start the roll of a move whose new position has already been applied to the block.
+   The orientation is committed at once, the shader then turns the cubes about the bottom edge
+   they tipped over, from the old pose (angle still to go) to the new one (no angle left) */
+void startroll(int turn,glm::vec3 dir)
+{
+  glm::vec3 pos[2]={glm::vec3(block.x1,block.y1,block.z1),glm::vec3(block.x2,block.y2,block.z2)};
+  float lead=1e9,bottom=1e9;
+  int k;
+  block.rollstart=gametime;
+  block.rollaxis=turnaxis[turn];
+  for(k=0;k<2;k++)
+  {
+    block.rollangle[k]=0;
+    if(breakblock!=0 && presentblock!=k)
+    continue;
+    block.orientation[k]=orientationturn[block.orientation[k]][turn];
+    block.rollangle[k]=turnangle[turn];
+    lead=min(lead,glm::dot(pos[k],dir));
+    bottom=min(bottom,pos[k].z);
+  }
+  /* The pivot edge is the trailing bottom edge of the cubes' new footprint */
+  for(k=0;k<2;k++)
+  block.rollpivot[k]=dir*(lead-1)+glm::vec3(0,0,bottom-1);
+}
+void upkeypressed(float h1,float h2,float h3,float h4,float h5,float h6,float h7,float h8)
+{
+  if(block.x1==block.x2 && block.y1==block.y2)
+  {
+    block.y1+=h1;
+    block.y2+=h2;
+    block.z2+=h3;
+  }
+  else
+  {
+    if(block.x1==block.x2)
+    {
+      block.y1+=h4;
+      block.y2+=h5;
+      block.z2+=h6;
+    }
+    else
+    {
+      block.y1+=h7;
+      block.y2+=h8;
+    }
+  }
+//  cout<<(4-block.y1)/2<<" "<<(12+block.x1)/2<<" "<<(4-block.y2)/2<<" "<<(12+block.x2)/2<<endl;
+}
+void drag()
+{
+  // mouse_x is where the last cursor motion played put the cursor
+  if(view == 3 && leftmouse == 1)
+  {
+    camera_rotation_angle -= (mouse_x-lgx)/800;
+  }
+}
+glm::vec3 getRGBfromHue (int hue)
+{
+  float intp;
+  float fracp = modff(hue/60.0, &intp);
+  float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+
+  if (hue < 60)
+    return glm::vec3(1,x,0);
+  else if (hue < 120)
+    return glm::vec3(x,1,0);
+  else if (hue < 180)
+    return glm::vec3(0,1,x);
+  else if (hue < 240)
+    return glm::vec3(0,x,1);
+  else if (hue < 300)
+    return glm::vec3(x,0,1);
+  else
+    return glm::vec3(1,0,x);
+
+}
+int count=0,count1=0;
+/* Multi-draw indirect : the static pack drawn with one command per object. Each command's baseInstance
+   picks its record (the model matrix columns) in a buffer texture, through the per-instance drawIndex attribute */
+struct DrawElementsIndirectCommand {
+  GLuint count,instanceCount,firstIndex;
+  GLint baseVertex;
+  GLuint baseInstance;
+};
+#define RECORD_TEXELS 4
+GLuint PackArrayID,PackVertexBuffer,PackIndexBuffer,DrawIndexBuffer,DrawRecordBuffer,DrawRecordTexture,IndirectBuffer;
+int drawindexcapacity=0;
+
+/* Make room for n commands in the drawIndex attribute, which simply holds 0,1,2... */
+void growdrawindices(int n)
+{
+  if(n<=drawindexcapacity)
+  return;
+  drawindexcapacity=max(n,max(2*drawindexcapacity,256));
+  vector<GLint> index(drawindexcapacity);
+  int i;
+  for(i=0;i<drawindexcapacity;i++)
+  index[i]=i;
+  glBindBuffer(GL_ARRAY_BUFFER,DrawIndexBuffer);
+  glBufferData(GL_ARRAY_BUFFER,drawindexcapacity*sizeof(GLint),&index[0],GL_STATIC_DRAW);
+}
+/* Upload the static pack once every mesh is created, the CPU copy is dropped afterwards */
+void createstaticpack()
+{
+  indirectavailable=GLAD_GL_VERSION_4_3 || (GLAD_GL_ARB_multi_draw_indirect && (GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_base_instance));
+  glGenVertexArrays(1,&PackArrayID);
+  glGenBuffers(1,&PackVertexBuffer);
+  glGenBuffers(1,&PackIndexBuffer);
+  glGenBuffers(1,&DrawIndexBuffer);
+  glGenBuffers(1,&DrawRecordBuffer);
+  glGenBuffers(1,&IndirectBuffer);
+  glGenTextures(1,&DrawRecordTexture);
+  bindvertexarray(PackArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER,PackVertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER,packvertices.size(),&packvertices[0],GL_STATIC_DRAW);
+  glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,16,(void*)0);
+  glVertexAttribPointer(1,3,GL_UNSIGNED_BYTE,GL_TRUE,16,(void*)12);
+  enableattrib(0);
+  enableattrib(1);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,PackIndexBuffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER,packindices.size()*sizeof(GLushort),&packindices[0],GL_STATIC_DRAW);
+  growdrawindices(1);
+  glVertexAttribIPointer(5,1,GL_INT,0,(void*)0);
+  glVertexAttribDivisor(5,1);
+  enableattrib(5);
+  glBindBuffer(GL_TEXTURE_BUFFER,DrawRecordBuffer);
+  glBufferData(GL_TEXTURE_BUFFER,RECORD_TEXELS*sizeof(glm::vec4),NULL,GL_STREAM_DRAW);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_BUFFER,DrawRecordTexture);
+  glTexBuffer(GL_TEXTURE_BUFFER,GL_RGBA32F,DrawRecordBuffer);
+  glActiveTexture(GL_TEXTURE0);
+  cout<<"STATIC PACK: "<<packvertices.size()/16<<" vertices "<<packindices.size()<<" indices, multi-draw indirect "<<(indirectavailable?"available":"not available")<<endl;
+  vector<unsigned char>().swap(packvertices);
+  vector<GLushort>().swap(packindices);
+}
+
+/* UI layer : HUD text, the arrow pad and any other overlay are laid out on the CPU into one vertex stream,
+   drawn last with the fixed ortho projection of the UI in a single call. Elements are matched with last
+   frame's by the order they are submitted in, and only laid out again when their kind, text, placement
+   or colour changed. The glyphs come from a signed distance field atlas baked at build time by fontbake */
+#define UI_VERTEX 8            // floats a vertex : position, atlas u,v, colour
+#define UI_LINE_WIDTH 0.05f    // outlines, in UI units : about a pixel of the default window
+enum { UI_TEXT, UI_ARROW };
+FontGlyph glyphs[128];
+struct UiElement {
+  int kind;
+  string text;
+  glm::mat4 model;
+  glm::vec3 colour;
+  vector<GLfloat> vertices;    // 6 a glyph or outline edge
+  int first,count;             // vertices of the element in UiBuffer
+  bool changed;
+};
+vector<UiElement> uielements;
+int uiused=0,uiuploaded=0,uivertices=0;
+GLuint UiArrayID,UiBuffer,TextAtlas,UiProjectionID;
+float uiaspect=0;
+long uiframes=0,uilayouts=0,totaluielements=0;
+
+/* Load a font atlas file in one read, see fontatlas.h, into glyphs[] and TextAtlas */
+bool loadtextatlas(const char *atlasfile)
+{
+  FILE *in=fopen(atlasfile,"rb");
+  vector<char> data;
+  long size;
+  if(!in)
+  return false;
+  fseek(in,0,SEEK_END);
+  size=ftell(in);
+  fseek(in,0,SEEK_SET);
+  if(size>(long)sizeof(FontAtlasHeader))
+  {
+    data.resize(size);
+    if(fread(&data[0],size,1,in)!=1)
+    data.clear();
+  }
+  fclose(in);
+  if(data.empty())
+  return false;
+  const FontAtlasHeader *header=(const FontAtlasHeader*)&data[0];
+  // The glyph range and the size are checked before anything past the header is pointed at,
+  // without sums that could wrap around
+  if(header->magic!=FONT_ATLAS_MAGIC || header->version!=FONT_ATLAS_VERSION ||
+     header->numglyphs>128 || header->firstchar>128-header->numglyphs ||
+     sizeof(*header)+header->numglyphs*sizeof(FontGlyph)+(size_t)header->width*header->height!=(size_t)size)
+  {
+    cout<<"Error: `"<<atlasfile<<"' is not a font atlas of this version, rebuild it with make"<<endl;
+    return false;
+  }
+  const FontGlyph *table=(const FontGlyph*)(header+1);
+  const unsigned char *field=(const unsigned char*)(table+header->numglyphs);
+  memset(glyphs,0,sizeof(glyphs));
+  memcpy(&glyphs[header->firstchar],table,header->numglyphs*sizeof(FontGlyph));
+  glGenTextures(1,&TextAtlas);
+  glBindTexture(GL_TEXTURE_2D,TextAtlas);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+  glTexImage2D(GL_TEXTURE_2D,0,GL_R8,header->width,header->height,0,GL_RED,GL_UNSIGNED_BYTE,field);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+  glGenVertexArrays(1,&UiArrayID);
+  glGenBuffers(1,&UiBuffer);
+  bindvertexarray(UiArrayID);
+  glBindBuffer(GL_ARRAY_BUFFER,UiBuffer);
+  glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,UI_VERTEX*sizeof(GLfloat),(void*)0);
+  glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,UI_VERTEX*sizeof(GLfloat),(void*)(3*sizeof(GLfloat)));
+  glVertexAttribPointer(2,3,GL_FLOAT,GL_FALSE,UI_VERTEX*sizeof(GLfloat),(void*)(5*sizeof(GLfloat)));
+  enableattrib(0);
+  enableattrib(1);
+  enableattrib(2);
+  cout<<"TEXT ATLAS: "<<atlasfile<<" "<<header->width<<"x"<<header->height<<", "<<header->numglyphs<<" glyphs"<<endl;
+  return true;
+}
+/* Two triangles from four corners placed by the element's model matrix. Corners with a negative u are
+   solid : uibatch.frag fills them without reading the atlas */
+void emitquad(UiElement &el,const float corner[4][4])
+{
+  static const int order[6]={0,1,2,2,3,0};
+  int v;
+  for(v=0;v<6;v++)
+  {
+    const float *c=corner[order[v]];
+    glm::vec4 p=el.model*glm::vec4(c[0],c[1],0,1);
+    GLfloat vertex[UI_VERTEX]={p.x,p.y,p.z,c[2],c[3],el.colour[0],el.colour[1],el.colour[2]};
+    el.vertices.insert(el.vertices.end(),vertex,vertex+UI_VERTEX);
+  }
+}
+/* One glyph quad a character */
+void layouttext(UiElement &el)
+{
+  float pen=0;
+  size_t k;
+  for(k=0;k<el.text.size();k++)
+  {
+    unsigned char c=el.text[k];
+    FontGlyph &g=glyphs[c<128?c:'?'];
+    if(g.width>0)
+    {
+      float x0=pen+g.left,x1=x0+g.width,y1=g.top,y0=y1-g.height;
+      float corner[4][4]={{x0,y0,g.u0,g.v1},{x1,y0,g.u1,g.v1},{x1,y1,g.u1,g.v0},{x0,y1,g.u0,g.v0}};
+      emitquad(el,corner);
+    }
+    pen+=g.advance;
+  }
+}
+/* Outline of the arrow pad's triangle, pointing up from (0,1) to (-1,-1) and (1,-1), one thin quad an edge */
+void layoutarrow(UiElement &el)
+{
+  static const glm::vec2 point[3]={glm::vec2(0,1),glm::vec2(-1,-1),glm::vec2(1,-1)};
+  glm::vec3 scale(glm::length(glm::vec3(el.model[0])),glm::length(glm::vec3(el.model[1])),1);
+  int k;
+  for(k=0;k<3;k++)
+  {
+    glm::vec2 p=point[k],q=point[(k+1)%3],d=glm::normalize(q-p);
+    // half the line width across the edge, measured after the model's scale
+    glm::vec2 n=glm::vec2(-d.y/scale.x,d.x/scale.y)*(0.5f*UI_LINE_WIDTH);
+    float corner[4][4]={{p.x-n.x,p.y-n.y,-1,0},{q.x-n.x,q.y-n.y,-1,0},{q.x+n.x,q.y+n.y,-1,0},{p.x+n.x,p.y+n.y,-1,0}};
+    emitquad(el,corner);
+  }
+}
+/* Take the next element of the frame, laying it out only if it differs from last frame's element in that place */
+bool adduielement(int kind,const char *text,glm::mat4 model,glm::vec3 colour)
+{
+  if(uiused==(int)uielements.size())
+  {
+    uielements.push_back(UiElement());
+    uielements.back().count=-1;
+  }
+  UiElement &el=uielements[uiused++];
+  if(el.count<0 || el.kind!=kind || el.text!=text || el.model!=model || el.colour!=colour)
+  {
+    el.kind=kind;
+    el.text=text;
+    el.model=model;
+    el.colour=colour;
+    el.vertices.clear();
+    if(kind==UI_TEXT)
+    layouttext(el);
+    else
+    layoutarrow(el);
+    el.changed=true;
+    uilayouts++;
+  }
+  return uiused==1;
+}
+/* Bring UiBuffer up to date and draw every element of the frame. A changed element that kept its length is
+   patched in place, anything else rebuilds the buffer from the laid out elements */
+void drawuibatch()
+{
+  int k;
+  bool rebuild=uiused!=uiuploaded;
+  for(k=0;k<uiused && !rebuild;k++)
+  if(uielements[k].changed && (int)uielements[k].vertices.size()/UI_VERTEX!=uielements[k].count)
+  rebuild=true;
+  glBindBuffer(GL_ARRAY_BUFFER,UiBuffer);
+  if(rebuild)
+  {
+    vector<GLfloat> data;
+    for(k=0;k<uiused;k++)
+    {
+      UiElement &el=uielements[k];
+      el.first=data.size()/UI_VERTEX;
+      el.count=el.vertices.size()/UI_VERTEX;
+      el.changed=false;
+      data.insert(data.end(),el.vertices.begin(),el.vertices.end());
+    }
+    glBufferData(GL_ARRAY_BUFFER,data.size()*sizeof(GLfloat),data.empty()?NULL:&data[0],GL_DYNAMIC_DRAW);
+    uivertices=data.size()/UI_VERTEX;
+    uiuploaded=uiused;
+  }
+  else
+  {
+    for(k=0;k<uiused;k++)
+    {
+      UiElement &el=uielements[k];
+      if(!el.changed)
+      continue;
+      if(el.count>0)
+      glBufferSubData(GL_ARRAY_BUFFER,el.first*UI_VERTEX*sizeof(GLfloat),el.vertices.size()*sizeof(GLfloat),&el.vertices[0]);
+      el.changed=false;
+    }
+  }
+  totaluielements+=uiused;
+  uiframes++;
+  uiused=0;
+  if(uivertices==0)
+  return;
+  // the UI keeps the 40x40 square of the ortho views whatever the camera, widened on the longer side
+  if(aspect!=uiaspect)
+  {
+    glm::mat4 projection;
+    if(aspect>=1)
+    projection=glm::ortho(-20.0f*aspect, 20.0f*aspect, -20.0f, 20.0f, -1.0f, 1.0f);
+    else
+    projection=glm::ortho(-20.0f, 20.0f, -20.0f/aspect, 20.0f/aspect, -1.0f, 1.0f);
+    glUniformMatrix4fv(UiProjectionID, 1, GL_FALSE, &projection[0][0]);
+    uiaspect=aspect;
+  }
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D,TextAtlas);
+  setpolygonmode (GL_FILL);
+  bindvertexarray (UiArrayID);
+  // drawn over the whole scene : glyph edges are blended and nothing is depth tested or written
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+  glDisable(GL_DEPTH_TEST);
+  glDepthMask(GL_FALSE);
+  glDrawArrays(GL_TRIANGLES, 0, uivertices);
+  glDepthMask(GL_TRUE);
+  glEnable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+}
+
+/* Render queue : draw() submits the frame as a list of items, flushrenderqueue() sorts them by
+   pass, program and VAO and only then issues GL */
+enum { PASS_BOARD, PASS_WORLD, PASS_HUD, PASSES };
+const char *passname[PASSES]={"board","world","hud"};
+/* What an item draws : a VAO, a rolling block cube, the board, or the HUD text batch.
+   The view and projection come from the FrameMatrices block, items only carry their model matrix */
+enum { ITEM_OBJECT, ITEM_ROLL, ITEM_BOARD, ITEM_UI };
+struct RenderItem {
+  int pass,kind,order;
+  GLuint program;
+  VAO *vao;             // NULL for the board and the UI
+  glm::mat4 model;      // unused by the board
+  glm::vec3 pivot;      // roll pivot
+  float angle;          // roll angle still to turn
+};
+vector<RenderItem> renderqueue;
+long passitems[PASSES],totalpassitems[PASSES],queueframes=0,drawcalls=0,totaldrawcalls=0;
+
+RenderItem &submititem(int pass,int kind,GLuint program,VAO *vao,glm::mat4 model)
+{
+  RenderItem item;
+  item.pass=pass;
+  item.kind=kind;
+  item.order=renderqueue.size();
+  item.program=program;
+  item.vao=vao;
+  item.model=model;
+  item.angle=0;
+  renderqueue.push_back(item);
+  return renderqueue.back();
+}
+void submitobject(int pass,GLuint program,VAO *vao,glm::mat4 model)
+{
+  submititem(pass,ITEM_OBJECT,program,vao,model);
+}
+/* Strings and arrows go into the UI batch, which the first element of the frame puts in the queue */
+void submitui(int kind,const char *text,glm::mat4 model,glm::vec3 colour)
+{
+  if(adduielement(kind,text,model,colour))
+  submititem(PASS_HUD,ITEM_UI,uiProgramID,NULL,glm::mat4(1.0f));
+}
+void submittext(const char *text,glm::mat4 model,glm::vec3 colour)
+{
+  submitui(UI_TEXT,text,model,colour);
+}
+/* An arrow of the pad at (x,y), turned by angle degrees from pointing up */
+void submitarrow(float x,float y,float angle,glm::vec3 colour)
+{
+  glm::mat4 model=glm::translate(glm::vec3(x,y,0))*glm::rotate((float)(angle*M_PI/180.0f),glm::vec3(0,0,1));
+  submitui(UI_ARROW,"",model,colour);
+}
+/* BOARD_TILES : one item per tile, drawn one by one or all in one indirect call */
+void submitboardtiles()
+{
+  int i,j;
+  for(i=visiblecells.r0;i<=visiblecells.r1;i++)
+  {
+    for(j=visiblecells.c0;j<=visiblecells.c1;j++)
+    {
+  if(showncell(i,j)!=0)
+  {
+  Matrices.model = glm::mat4(1.0f);
+  glm::mat4 translatetile = glm::translate (glm::vec3(2*j-(int)shown->board_length-2,-2*i+(int)shown->board_width-2,-zshift));        // glTranslatef
+  Matrices.model *= translatetile;
+  submitobject(PASS_BOARD,programID,tilecache[tilekind(i,j)],Matrices.model);
+  }
+  }
+ }
+}
+/* Items the indirect path can take : objects and rolling cubes whose mesh is in the static pack */
+bool packeditem(const RenderItem &item)
+{
+  return (item.kind==ITEM_OBJECT || item.kind==ITEM_ROLL) && item.vao->PackFirstIndex>=0;
+}
+/* Fill the record and the command of every packed item, in queue order */
+void buildindirect(vector<RenderItem*> &sorted)
+{
+  vector<glm::vec4> records;
+  vector<DrawElementsIndirectCommand> commands;
+  size_t i;
+  int k;
+  for(i=0;i<sorted.size();i++)
+  {
+    RenderItem &item=*sorted[i];
+    if(!packeditem(item))
+    continue;
+    glm::mat4 model=item.model;
+    // the roll the shader does in the plain path, folded into the model
+    if(item.kind==ITEM_ROLL && item.angle!=0)
+    model=glm::translate(item.pivot)*glm::rotate(item.angle,shown->block.rollaxis)*glm::translate(-item.pivot)*model;
+    DrawElementsIndirectCommand command;
+    command.count=item.vao->NumIndices;
+    command.instanceCount=1;
+    command.firstIndex=item.vao->PackFirstIndex;
+    command.baseVertex=item.vao->PackBaseVertex;
+    command.baseInstance=commands.size();
+    commands.push_back(command);
+    for(k=0;k<4;k++)
+    records.push_back(model[k]);
+  }
+  if(commands.empty())
+  return;
+  growdrawindices(commands.size());
+  glBindBuffer(GL_TEXTURE_BUFFER,DrawRecordBuffer);
+  glBufferData(GL_TEXTURE_BUFFER,records.size()*sizeof(glm::vec4),&records[0],GL_STREAM_DRAW);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER,IndirectBuffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER,commands.size()*sizeof(DrawElementsIndirectCommand),&commands[0],GL_STREAM_DRAW);
+}
+/* qsort order of the queue : pass, then program, then VAO, then submission order */
+int comparerenderitems(const void *p,const void *q)
+{
+  const RenderItem *a=*(const RenderItem **)p,*b=*(const RenderItem **)q;
+  GLuint va=a->vao?a->vao->VertexArrayID:0,vb=b->vao?b->vao->VertexArrayID:0;
+  if(a->pass!=b->pass)
+  return a->pass<b->pass?-1:1;
+  if(a->program!=b->program)
+  return a->program<b->program?-1:1;
+  if(va!=vb)
+  return va<vb?-1:1;
+  return a->order-b->order;
+}
+/* Point the scene passes at the offscreen framebuffer, sized for the whole window and drawn into its
+   renderscale corner. Does nothing when dynamic resolution is off */
+void beginscene()
+{
+  scaledscene=dynamicresolution;
+  if(!scaledscene)
+  return;
+  if(scenewidth!=framewidth || sceneheight!=frameheight)
+  {
+    if(scenewidth==0)
+    {
+      glGenFramebuffers(1,&SceneFramebuffer);
+      glGenRenderbuffers(1,&SceneColour);
+      glGenRenderbuffers(1,&SceneDepth);
+      glGenQueries(SCENE_TIMERS,scenetimers);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER,SceneColour);
+    glRenderbufferStorage(GL_RENDERBUFFER,GL_RGBA8,framewidth,frameheight);
+    glBindRenderbuffer(GL_RENDERBUFFER,SceneDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,framewidth,frameheight);
+    glBindFramebuffer(GL_FRAMEBUFFER,SceneFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_RENDERBUFFER,SceneColour);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,SceneDepth);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE)
+    {
+      cout<<"DYNAMIC RESOLUTION: offscreen framebuffer incomplete, turned off"<<endl;
+      glBindFramebuffer(GL_FRAMEBUFFER,0);
+      dynamicresolution=scaledscene=false;
+      return;
+    }
+    scenewidth=framewidth;
+    sceneheight=frameheight;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER,SceneFramebuffer);
+  glViewport(0,0,(int)(framewidth*renderscale+0.5f),(int)(frameheight*renderscale+0.5f));
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glBeginQuery(GL_TIME_ELAPSED,scenetimers[scenetimer]);
+}
+/* Stretch the scene onto the window and go back to drawing there at full size */
+void endscene()
+{
+  if(!scaledscene)
+  return;
+  int w=(int)(framewidth*renderscale+0.5f),h=(int)(frameheight*renderscale+0.5f);
+  glEndQuery(GL_TIME_ELAPSED);
+  scenetimerissued[scenetimer]=true;
+  scenetimer=(scenetimer+1)%SCENE_TIMERS;
+  glBindFramebuffer(GL_READ_FRAMEBUFFER,SceneFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER,0);
+  glBlitFramebuffer(0,0,w,h,0,0,framewidth,frameheight,GL_COLOR_BUFFER_BIT,GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER,0);
+  glViewport(0,0,framewidth,frameheight);
+  scaledscene=false;
+}
+/* Once a frame, with the time since the last one. Software renderers rasterise at the swap, outside the
+   timer query, so the wall clock decides when frames are late : the scale then backs off by a tenth.
+   After RENDER_SCALE_PATIENCE frames on time it creeps back up, as far as the GPU time of the scene allows,
+   the fill cost going with the pixel count. Each change is left to settle before the next one */
+void updaterenderscale(double frametime)
+{
+  int oldest=scenetimer;
+  GLint available=0;
+  if(!dynamicresolution)
+  return;
+  cpuframetime=0.8*cpuframetime+0.2*frametime;
+  if(scenetimerissued[oldest])
   {
-    block.x1+=h1;
-    block.x2+=h2;
-    block.z2+=h3;
+    glGetQueryObjectiv(scenetimers[oldest],GL_QUERY_RESULT_AVAILABLE,&available);
+    if(available)
+    {
+      GLuint64 ns;
+      glGetQueryObjectui64v(scenetimers[oldest],GL_QUERY_RESULT,&ns);
+      gpuscenetime=0.8*gpuscenetime+0.2*ns*1e-9;
+      scenetimerissued[oldest]=false;
+    }
   }
-  else
+  if(settleframes>0)
   {
-    if(block.x1==block.x2)
+    settleframes--;
+    return;
+  }
+  // what the scene would take at full size, 85% of the budget is left for it
+  double full=gpuscenetime/(renderscale*renderscale),room=0.85*FRAME_BUDGET;
+  if(cpuframetime>1.2*FRAME_BUDGET || full*renderscale*renderscale>room)
+  {
+    if(renderscale>MIN_RENDER_SCALE)
     {
-      block.x1+=h4;
-      block.x2+=h5;
+      renderscale=(renderscale*0.9f>MIN_RENDER_SCALE)?renderscale*0.9f:MIN_RENDER_SCALE;
+      settleframes=RENDER_SCALE_SETTLE;
     }
-    else
+    ontimeframes=0;
+  }
+  else if(renderscale<1 && ++ontimeframes>=RENDER_SCALE_PATIENCE)
+  {
+    float up=(renderscale+0.05f<1)?renderscale+0.05f:1;
+    if(full*up*up<=room)
     {
-      block.x1+=h6;
-      block.x2+=h7;
-      block.z2+=h8;
+      renderscale=up;
+      settleframes=RENDER_SCALE_SETTLE;
     }
+    ontimeframes=0;
   }
-  //cout<<(4-block.y1)/2<<" "<<(12+block.x1)/2<<" "<<(4-block.y2)/2<<" "<<(12+block.x2)/2<<endl;
 }
-void upkeypressed(float h1,float h2,float h3,float h4,float h5,float h6,float h7,float h8)
+void flushrenderqueue()
 {
-  if(block.x1==block.x2 && block.y1==block.y2)
+  // drawmode is DRAW_PLAIN between frames, the board and plain objects rely on it
+  int drawmode=DRAW_PLAIN,command=0;
+  bool indirect=indirectdraw && indirectavailable;
+  size_t i,j;
+  vector<RenderItem*> sorted(renderqueue.size());
+  for(i=0;i<renderqueue.size();i++)
   {
-    block.y1+=h1;
-    block.y2+=h2;
-    block.z2+=h3;
+    sorted[i]=&renderqueue[i];
+    passitems[renderqueue[i].pass]++;
   }
-  else
+  if(!sorted.empty())
+  qsort(&sorted[0],sorted.size(),sizeof(RenderItem*),comparerenderitems);
+  if(indirect)
+  buildindirect(sorted);
+  beginscene();
+  for(i=0;i<sorted.size();i++)
   {
-    if(block.x1==block.x2)
+    RenderItem &item=*sorted[i];
+    bool packed=indirect && packeditem(item);
+    if(item.pass==PASS_HUD)
+    endscene();
+    GLuint program=packed?programID:item.program;
+    if(program!=programID && drawmode!=DRAW_PLAIN)
     {
-      block.y1+=h4;
-      block.y2+=h5;
-      block.z2+=h6;
+      glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+      drawmode=DRAW_PLAIN;
+    }
+    useprogram(program);
+    drawcalls++;
+    if(packed)
+    {
+      // One call for the run of packed items of this pass that share the fill mode
+      for(j=i+1;j<sorted.size() && packeditem(*sorted[j]) && sorted[j]->pass==item.pass && sorted[j]->vao->FillMode==item.vao->FillMode;j++);
+      if(drawmode!=DRAW_INDIRECT)
+      {
+        glUniform1i(Matrices.DrawModeID, DRAW_INDIRECT);
+        drawmode=DRAW_INDIRECT;
+      }
+      setpolygonmode(item.vao->FillMode);
+      bindvertexarray(PackArrayID);
+      glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (void*)(intptr_t)(command*sizeof(DrawElementsIndirectCommand)), j-i, 0);
+      command+=j-i;
+      i=j-1;
     }
+    else if(item.kind==ITEM_BOARD)
+    {
+      drawboard();
+      drawmode=DRAW_PLAIN;
+    }
+    else if(item.kind==ITEM_ROLL)
+    {
+      if(drawmode!=DRAW_BLOCK_ROLL)
+      {
+        glUniform1i(Matrices.DrawModeID, DRAW_BLOCK_ROLL);
+        glUniform3fv(Matrices.RollAxisID, 1, &shown->block.rollaxis[0]);
+        drawmode=DRAW_BLOCK_ROLL;
+      }
+      glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &item.model[0][0]);
+      glUniform3fv(Matrices.RollPivotID, 1, &item.pivot[0]);
+      glUniform1f(Matrices.RollAngleID, item.angle);
+      draw3DObject(item.vao);
+    }
+    else if(item.kind==ITEM_UI)
+    drawuibatch();
     else
     {
-      block.y1+=h7;
-      block.y2+=h8;
+      if(drawmode!=DRAW_PLAIN)
+      {
+        glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+        drawmode=DRAW_PLAIN;
+      }
+      glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &item.model[0][0]);
+      draw3DObject(item.vao);
     }
   }
-//  cout<<(4-block.y1)/2<<" "<<(12+block.x1)/2<<" "<<(4-block.y2)/2<<" "<<(12+block.x2)/2<<endl;
-}
-void drag(GLFWwindow* window)
-{
-  double lx1;
-  double ly1;
-  glfwGetCursorPos(window,&lx1,&ly1);
-  if(view == 3 && leftmouse == 1)
+  endscene();
+  if(drawmode!=DRAW_PLAIN)
+  glUniform1i(Matrices.DrawModeID, DRAW_PLAIN);
+  for(i=0;i<PASSES;i++)
   {
-    camera_rotation_angle -= (lx1-lgx)/800;
+    totalpassitems[i]+=passitems[i];
+    passitems[i]=0;
   }
+  totaldrawcalls+=drawcalls;
+  drawcalls=0;
+  queueframes++;
+  renderqueue.clear();
 }
-glm::vec3 getRGBfromHue (int hue)
+void reportrenderqueue()
 {
-  float intp;
-  float fracp = modff(hue/60.0, &intp);
-  float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
-
-  if (hue < 60)
-    return glm::vec3(1,x,0);
-  else if (hue < 120)
-    return glm::vec3(x,1,0);
-  else if (hue < 180)
-    return glm::vec3(0,1,x);
-  else if (hue < 240)
-    return glm::vec3(0,x,1);
-  else if (hue < 300)
-    return glm::vec3(x,0,1);
-  else
-    return glm::vec3(1,0,x);
-
+  int p;
+  if(queueframes==0)
+  return;
+  cout<<"Render queue : items per frame";
+  for(p=0;p<PASSES;p++)
+  cout<<" "<<passname[p]<<" "<<(double)totalpassitems[p]/queueframes;
+  cout<<", "<<(double)totaldrawcalls/queueframes<<" draw calls per frame over "<<queueframes<<" frames"<<endl;
+  if(uiframes>0)
+  cout<<"UI : "<<(double)totaluielements/uiframes<<" elements per frame in one draw, "<<uilayouts<<" laid out over "<<uiframes<<" frames"<<endl;
 }
-int count=0,count1=0;
-int draw (int presentlevel)
+/* Upload view, projection and their products, unless they are those of the last upload */
+void setframematrices(int v,int version)
+{
+  static int lastview=-1,lastversion=-1;
+  if(v==lastview && version==lastversion)
+  return;
+  lastview=v;
+  lastversion=version;
+  frame.view=Matrices.view;
+  frame.projection=Matrices.projection;
+  frame.VP=Matrices.projection*Matrices.view;
+  glBindBuffer(GL_UNIFORM_BUFFER,FrameMatricesBuffer);
+  glBufferSubData(GL_UNIFORM_BUFFER,0,sizeof(frame),&frame);
+}
+/* What update() may change on its own from one tick to the next, falls and level 4's split block among them.
+   While it keeps changing, frames keep coming */
+struct GameState {
+  float x1,y1,z1,x2,y2,z2;
+  int orientation[2],level,lives,gamestart,breakblock,count,moves;
+};
+bool statechanged=true;
+bool gamestatechanged()
 {
+  static GameState last;
+  GameState now;
+  memset(&now,0,sizeof(now));
+  now.x1=block.x1; now.y1=block.y1; now.z1=block.z1;
+  now.x2=block.x2; now.y2=block.y2; now.z2=block.z2;
+  now.orientation[0]=block.orientation[0];
+  now.orientation[1]=block.orientation[1];
+  now.level=level;
+  now.lives=lives;
+  now.gamestart=gamestart;
+  now.breakblock=breakblock;
+  now.count=count;
+  now.moves=present_moves[level];
+  bool changed=memcmp(&now,&last,sizeof(now))!=0;
+  last=now;
+  return changed;
+}
+/* One tick of the game, returns the level to play next */
+int update (int presentlevel)
+{
+  // The next queued move starts once the roll before it is over
+  if(movecount>0 && gametime-block.rollstart>=ROLL_TIME)
+  {
+    int move=movequeue[movefirst];
+    movefirst=(movefirst+1)%MOVE_QUEUE;
+    movecount--;
+    moveblock(move);
+  }
 	presentlives=lives;
 	if(present_moves[level]<0)
 	{
 		lives--;
 	}
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
-
-  // Eye - Location of camera. Don't change unless you are sure!!
-  // glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  // glm::vec3 target (0,0, 0);
-  // // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  // glm::vec3 up (0, 1, 0);
-
-  // Compute Camera matrix (view)
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-	  if(view==0)
-    /*tower view*/Matrices.view = glm::lookAt(glm::vec3(-20,-20,15), glm::vec3(0,0,0), glm::vec3(1,1,8/3)); // Fixed camera for 2D (ortho) in XY plane
-    else if(view==1)
-    /*topview*/Matrices.view = glm::lookAt(glm::vec3(0,0,15), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-    else if(view==2)
-    /*backview*/Matrices.view =glm::lookAt(glm::vec3(20,20,15), glm::vec3(0,0,0), glm::vec3(1,1,8/3));
-    else if(view==3)
-    /*helicopter view*/Matrices.view =glm::lookAt(glm::vec3(-20*cos(camera_rotation_angle*M_PI/180),-20*sin(camera_rotation_angle*M_PI/180),15), glm::vec3(0,0,0), glm::vec3(1,1,8/3));
-		else if(view==4)
-		{
-			/*block view*/
-			Matrices.view =glm::lookAt(glm::vec3(block.x2+1,block.y2,block.z2+1), glm::vec3(block.x2+3,block.y2,block.z2), glm::vec3(0,0,1));
-	  }
-		else
-		{
-			/*follow cam view*/
-			Matrices.view =glm::lookAt(glm::vec3(block.x2-6,block.y2,block.z2+5), glm::vec3(block.x2+3,block.y2,block.z2+2), glm::vec3(0,0,1));
-		}
-  //Matrices.view = glm::lookAt(glm::vec3(-20,-20,15), glm::vec3(0,0,0), glm::vec3(1,1,8/3)); // Fixed camera for 2D (ortho) in XY plane
-
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
-
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
-//  glUseProgram(fontProgramID);
-  // Load identity to model matrix
+  gametime+=UPDATE_TICK;
+  lastlevelshift=levelshift;
 	if(gamestart==1)
 	{
-  int i,j;
-  //cout<<block.xlength<<" "<<block.ylength<<endl;
-  if(zshift>0)
-  {
-    zshift-=0.2;
-  }
-  for(i=0;i< 20;i++)
-  {
-    for(j=0;j< 20;j++)
-    {
-  if(a[i][j]!=0)
-  {
-  if(level==4 && i==5 && j==5)
-  {
-  createtile(1,1,0.2,0,0,0,0,0,0,0,-1);
-  }
-  else if(a[i][j]==1)
-  createtile(1,1,0.2,0,0.87,0.87,0.87,0.627,0.627,0.627,-1);
-  else
-  createtile(1,1,0.2,0,1,0.5,0,1,0.7,0.4,-1);
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translatetile = glm::translate (glm::vec3(2*j-(int)board_length-2,-2*i+(int)board_width-2,-zshift));        // glTranslatef
-  glm::mat4 rotatetile = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatetile * rotatetile);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(tile);
-  }
-  }
- }
- if(right_angle>0 && right_angle<=90)
- {
-//cout<<right_angle<<endl;
- if(breakblock==0)
- {
- block.rotationmatrix[0]=glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
- block.rotationmatrix[1]=glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
- }
- if(presentblock==0)
- {
-   block.rotationmatrix[0]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
- }
- if(presentblock==1)
- block.rotationmatrix[1]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
- right_angle+=45;
- }
- else
- right_angle=0;
- if(left_angle>0 && left_angle<=90)
- {
-   if(breakblock==0)
-   {
-   block.rotationmatrix[0]=glm::rotate((float)(-45*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
-   block.rotationmatrix[1]=glm::rotate((float)(-45*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
-   }
-   if(presentblock==0)
-   {
-     block.rotationmatrix[0]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
-   }
-   if(presentblock==1)
-   block.rotationmatrix[1]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
-   left_angle+=45;
- }
- else
- left_angle=0;
- if(up_angle>0 && up_angle<=90)
- {
-  //cout<<up_angle<<endl;
-  if(breakblock==0)
+  if(levelshift>0)
   {
-  block.rotationmatrix[0]=glm::rotate((float)(-45*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-  block.rotationmatrix[1]=glm::rotate((float)(-45*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
+    levelshift-=0.2;
   }
-  if(presentblock==0)
-  block.rotationmatrix[0]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-  if(presentblock==1)
-  block.rotationmatrix[1]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
-  up_angle+=45;
- }
- else
- up_angle=0;
- if(down_angle>0 && down_angle<=90)
- {
-   if(breakblock==0)
-   {
-   block.rotationmatrix[0]=glm::rotate((float)(45*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-   block.rotationmatrix[1]=glm::rotate((float)(45*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
-   }
-   if(presentblock==0)
-   block.rotationmatrix[0]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-   if(presentblock==1)
-   block.rotationmatrix[1]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
-   down_angle+=45;
- }
- else
- down_angle=0;
  int x1,y1,x2,y2,z1,z2;
  x1=(int)(board_width-2-block.y1)/2;
  y1=(int)(block.x1+board_length+2)/2;
  x2=(int)(board_width-2-block.y2)/2;
  y2=(int)(block.x2+board_length+2)/2;
  //cout<<x1<<" "<<y1<<" "<<x2<<" "<<y2<<endl;
-if(a[x1][y1]==2 && x1==x2 && y1==y2)
+if(boardcell(x1,y1)==2 && x1==x2 && y1==y2)
 {
-  a[x1][y1]=0;
+  setcell(x1,y1,0);
 }
 if(block.z1<=-20 || block.z2<=-20)
 {
-	char level_str[30];
-	sprintf(level_str,"CONGRATS!! YOU REACHED LEVEL %d",level);
-	func(100,3,level_str,-15,0);
 	gamestart=2;
   //exit(0);
 }
-if(count ==0 && a[x1][y1]==0 && a[x2][y2]==0)
+if(count ==0 && boardcell(x1,y1)==0 && boardcell(x2,y2)==0)
 {
 	count=1;
   if(x1==x2 && y1==y2 && x1==block.goal_x && y1==block.goal_y)
@@ -1003,21 +2705,21 @@ if(count ==0 && a[x1][y1]==0 && a[x2][y2]==0)
   block.z2-=1;
   }
 }
-else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
+else if(count==0 && (boardcell(x1,y1)==0 || boardcell(x2,y2)==0))
 {
   count=1;
-  if(a[x2][y2]==0 && x2==block.goal_x && y2==block.goal_y)
+  if(boardcell(x2,y2)==0 && x2==block.goal_x && y2==block.goal_y)
   {
   }
-  else if(a[x2][y2]==0)
+  else if(boardcell(x2,y2)==0)
   {
     if(x1==block.goal_x && y1==block.goal_y)
     {
     }
     else if(x1-1==x2)
     {
-      block.rotationmatrix[0]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-      block.rotationmatrix[1]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
+      block.orientation[0]=orientationturn[block.orientation[0]][TURN_UP];
+      block.orientation[1]=orientationturn[block.orientation[1]][TURN_UP];
       block.y1+=2;
       block.z1-=2;
 			lives--;
@@ -1025,26 +2727,26 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
     }
     else
     {
-      block.rotationmatrix[0]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
-      block.rotationmatrix[1]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
+      block.orientation[0]=orientationturn[block.orientation[0]][TURN_RIGHT];
+      block.orientation[1]=orientationturn[block.orientation[1]][TURN_RIGHT];
       block.x1+=2;
       block.z1-=2;
 			lives--;
 			present_moves[level]=moves[level]+6;
     }
   }
-  else if(a[x1][y1]==0 && x1==block.goal_x && y1==block.goal_y)
+  else if(boardcell(x1,y1)==0 && x1==block.goal_x && y1==block.goal_y)
   {
   }
-  else if(a[x1][y1]==0)
+  else if(boardcell(x1,y1)==0)
   {
     if(x2==block.goal_x && y2==block.goal_y)
     {
     }
     else if(y1==y2-1)
     {
-        block.rotationmatrix[0]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
-        block.rotationmatrix[1]=glm::rotate((float)(-90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[1];
+        block.orientation[0]=orientationturn[block.orientation[0]][TURN_LEFT];
+        block.orientation[1]=orientationturn[block.orientation[1]][TURN_LEFT];
         block.z1-=2;
         block.x2-=2;
 				lives--;
@@ -1052,8 +2754,8 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
     }
     else
     {
-      block.rotationmatrix[0]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[0];
-      block.rotationmatrix[1]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(1,0,0)) * block.rotationmatrix[1];
+      block.orientation[0]=orientationturn[block.orientation[0]][TURN_DOWN];
+      block.orientation[1]=orientationturn[block.orientation[1]][TURN_DOWN];
       block.z1-=2;
       block.y2-=2;
 			lives--;
@@ -1061,57 +2763,12 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
     }
   }
 }
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translatel = glm::translate(glm::vec3(block.translatex,block.translatey,0));
-    glm::mat4 translateblock = glm::translate (glm::vec3(block.x1,block.y1,block.z1+zshift));        // glTranslatef
-    // glm::mat4 rotateblockx = glm::rotate((float)(block.anglex*M_PI/180.0f), glm::vec3(1,0,0));
-    // glm::mat4 rotateblocky = glm::rotate((float)(block.angley*M_PI/180.0f), glm::vec3(0,1,0));
-    // block.rotationmatrix=rotateblocky*rotateblockx*block.rotationmatrix;
-    glm::mat4 translateblock2 = glm::translate (glm::vec3(-1*block.translatex,-1*block.translatey,0));
-    Matrices.model *= (translateblock*translateblock2*block.rotationmatrix[0]*translatel);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(brick[0]);
-
-    Matrices.model = glm::mat4(1.0f);
-    translatel = glm::translate(glm::vec3(block.translatex,block.translatey,0));
-    translateblock = glm::translate (glm::vec3(block.x2,block.y2,block.z2+zshift));
-    translateblock2 = glm::translate (glm::vec3(-1*block.translatex,-1*block.translatey,0));
-    Matrices.model *= (translateblock*translateblock2*block.rotationmatrix[1]*translatel);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(brick[1]);
     if(level==2)
     {
-      a[5][5]=active_circle;
-      a[5][6]=active_circle;
-      a[5][11]=active_into;
-      a[5][12]=active_into;
-      createcircle(1,0,0,0,-12,-2);
-      Matrices.model = glm::mat4(1.0f);
-      translatel = glm::translate(glm::vec3(0,0,0.2+zshift));
-      Matrices.model *= (translatel);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-      // draw3DObject draws the VAO given to it using current MVP matrix
-      draw3DObject(circle);
-
-      createRectangle(-1,0.8,-0.8,1,1,-0.8,0.8,-1,0,0,0,0);
-      createRectangle(-0.9,-1,1,0.9,0.9,1,-1,-0.9,0,0,0,1);
-      for(i=0;i<2;i++)
-      {
-      Matrices.model = glm::mat4(1.0f);
-      translatel = glm::translate(glm::vec3(0,0,0.2+zshift));
-      Matrices.model *= (translatel);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(rect[i]);
-      }
+      setcell(5,5,active_circle);
+      setcell(5,6,active_circle);
+      setcell(5,11,active_into);
+      setcell(5,12,active_into);
     }
     if(level==4)
     {
@@ -1129,9 +2786,9 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
         block.x2=4;
         block.y2=-9;
         block.z2=1.2;
-        block.rotationmatrix[1]=glm::mat4(1.0f);
-        block.rotationmatrix[0]=glm::mat4(1.0f);
-        //block.rotationmatrix[1]=block.rotationmatrix[0];
+        block.orientation[1]=0;
+        block.orientation[0]=0;
+        //block.orientation[1]=block.orientation[0];
         breakblock++;
       }
       if(breakblock>1)
@@ -1145,17 +2802,16 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
           block.y1=block.y2;
           block.y2=t;
           }
-          block.rotationmatrix[0]=glm::mat4(1.0f);
-          block.rotationmatrix[1]=block.rotationmatrix[0];
+          block.orientation[0]=0;
+          block.orientation[1]=block.orientation[0];
           //
           breakblock=0;
           presentblock=-1;
         }
         else if(fabs(y1-y2)==1 && x1==x2)
         {
-          block.rotationmatrix[0]=glm::mat4(1.0f);
-          block.rotationmatrix[0]=glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,1,0)) * block.rotationmatrix[0];
-          block.rotationmatrix[1]=block.rotationmatrix[0];
+          block.orientation[0]=orientationturn[0][TURN_RIGHT];
+          block.orientation[1]=block.orientation[0];
           if(block.x2<block.x1)
           {
            t=block.x1;
@@ -1166,177 +2822,377 @@ else if(count==0 && (a[x1][y1]==0 || a[x2][y2]==0))
           presentblock=-1;
         }
       }
+    }
+	if(lives==0)
+	gamestart=2;
+	}
+  statechanged=gamestatechanged();
+  return presentlevel;
+}
+/* Submit and draw the frame, alpha of the way from the state before the last tick to the state after it */
+void draw (float alpha)
+{
+  zshift=shown->lastlevelshift+(shown->levelshift-shown->lastlevelshift)*alpha;
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // The frame is submitted to the render queue and drawn by flushrenderqueue at the end
+  renderqueue.clear();
+
+  // The camera of the current view, rebuilt only when the block, the helicopter angle or the window changed
+  Camera &camera=updatecamera(shown->view);
+  Matrices.view=camera.view;
+  Matrices.projection=camera.projection;
+
+  // Written into the FrameMatrices block when the camera changed, each object then only sends its model matrix
+  setframematrices(shown->view,camera.version);
+
+//  glUseProgram(fontProgramID);
+  // Load identity to model matrix
+	if(shown->gamestart==1)
+	{
+  int i;
+  // The cells the camera can see, over the whole board for the chunked renderer and the first BOARD_SIZE rows and columns for the others
+  if(boardmode==BOARD_CHUNKED)
+  updatevisiblecells(camera,shownboard->rows,shownboard->cols);
+  else
+  updatevisiblecells(camera,BOARD_SIZE,BOARD_SIZE);
+  if(boardmode==BOARD_TILES)
+  submitboardtiles();
+  else
+  submititem(PASS_BOARD,ITEM_BOARD,programID,NULL,glm::mat4(1.0f));
+    // The shader rolls each cube in from its pose before the move, see startroll
+    float rollprogress=(shown->gametime-(1-alpha)*UPDATE_TICK-shown->block.rollstart)/ROLL_TIME;
+    if(rollprogress<0)
+    rollprogress=0;
+    if(rollprogress>1)
+    rollprogress=1;
+    glm::mat4 translatel,translateblock,translateblock2;
+    for(i=0;i<2;i++)
+    {
+    Matrices.model = glm::mat4(1.0f);
+    translatel = glm::translate(glm::vec3(shown->block.translatex,shown->block.translatey,0));
+    if(i==0)
+    translateblock = glm::translate (glm::vec3(shown->block.x1,shown->block.y1,shown->block.z1+zshift));        // glTranslatef
+    else
+    translateblock = glm::translate (glm::vec3(shown->block.x2,shown->block.y2,shown->block.z2+zshift));
+    translateblock2 = glm::translate (glm::vec3(-1*shown->block.translatex,-1*shown->block.translatey,0));
+    Matrices.model *= (translateblock*translateblock2*orientationmatrix[shown->block.orientation[i]]*translatel);
+    RenderItem &cube=submititem(PASS_WORLD,ITEM_ROLL,programID,brick[i],Matrices.model);
+    cube.pivot=shown->block.rollpivot[i]+glm::vec3(0,0,zshift);
+    cube.angle=-(1-rollprogress)*shown->block.rollangle[i]*M_PI/180.0f;
+    }
+    if(shown->level==2)
+    {
+      Matrices.model = glm::mat4(1.0f);
+      translatel = glm::translate(glm::vec3(0,0,0.2+zshift));
+      Matrices.model *= (translatel);
+      submitobject(PASS_WORLD,programID,circle,Matrices.model);
+
+      for(i=0;i<2;i++)
+      {
+      Matrices.model = glm::mat4(1.0f);
+      translatel = glm::translate(glm::vec3(0,0,0.2+zshift));
+      Matrices.model *= (translatel);
+      submitobject(PASS_WORLD,programID,rect[i],Matrices.model);
+      }
     }
 	int fontScale=20;
   float fontScaleValue = 2;
 	glm::vec3 fontColor = getRGBfromHue(fontScale);
-	glUseProgram(fontProgramID);
 
-
- 	char level_str[30];
-	if(level<=4)
-	sprintf(level_str,"LEVEL: %d",level);
+ 	char level_str[40];
+	if(shown->level<=4)
+	snprintf(level_str,sizeof(level_str),"LEVEL: %d",shown->level);
 	else
-  sprintf(level_str,"LEVEL: %d",4);
+  snprintf(level_str,sizeof(level_str),"LEVEL: %d",4);
 	func(20,2,level_str,10,17);
-	if(lives>0)
-	sprintf(level_str,"LIVES: %d",lives);
+	if(shown->lives>0)
+	snprintf(level_str,sizeof(level_str),"LIVES: %d",shown->lives);
 	else
-	sprintf(level_str,"LIVES: %d",0);
+	snprintf(level_str,sizeof(level_str),"LIVES: %d",0);
 	func(20,2,level_str,10,15);
-	if(presentlevel<5)
+	if(shown->level<5)
 	{
-	sprintf(level_str,"MOVES LEFT:%d",present_moves[level]);
+	snprintf(level_str,sizeof(level_str),"MOVES LEFT:%d",shown->moves);
 	func(20,2,level_str,-19,15);
   }
   current_time=glfwGetTime();
-	sprintf(level_str,"TIME:%.0lf",current_time-start_time);
+	snprintf(level_str,sizeof(level_str),"TIME:%.0lf",current_time-shown->start_time);
 	func(20,2,level_str,-2,17);
-	if(current_time-viewtime<1)
+	if(current_time-shown->viewtime<1)
 	{
-		if(view==0)
-		strcpy(level_str,"TOWER VIEW");
-		else if(view==1)
-		strcpy(level_str,"TOP VIEW");
-		else if(view==2)
-		strcpy(level_str,"BACK VIEW");
-		else if(view==3)
-		strcpy(level_str,"HELICOPTER VIEW");
-		else if(view==4)
-		strcpy(level_str,"BLOCK VIEW");
-		else
-		strcpy(level_str,"FOLLOW CAM VIEW");
+		strcpy(level_str,viewname[shown->view]);
 		func(100,3,level_str,-10,-10);
 	}
-	if(lives==0)
+	if(shown->lives==0)
 	{
-		char level_str[30];
-		sprintf(level_str,"CONGRATS!! YOU COMPLETED %d LEVELS",level-1);
+		char level_str[40];
+		snprintf(level_str,sizeof(level_str),"CONGRATS!! YOU COMPLETED %d LEVELS",shown->level-1);
 		func(100,3,level_str,-15,0);
-		gamestart=2;
-	  //exit(0);
    }
-	 if(view==4 || view==5)
- 	 Matrices.projection = glm::perspective (90.0f, (GLfloat)1000 / (GLfloat) 1000, 0.1f, 500.0f);
-	 else
-	 Matrices.projection = glm::ortho(-20.0f, 20.0f, -20.0f, 20.0f,  0.1f, 500.0f);
-//down
-	   Matrices.model = glm::mat4(1.0f);
-glm::mat4 translateTriangle11 = glm::translate (glm::vec3(9.5,-15 ,0 )); // glTranslatef
-                glm::mat4 rotateTriangle11 = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1));
-                glm::mat4 scaleTriangle11 = glm::scale (glm::vec3(2, 2, 1)); // glTranslatef
-                // rotate about vector (1,0,0)
-                glm::mat4 triangleTransform11 = translateTriangle11* rotateTriangle11*scaleTriangle11;
-                Matrices.model *= triangleTransform11;
-                //MVP = VP * Matrices.model; // MVP = p * V * M
-    MVP = Matrices.projection * Matrices.view * Matrices.model;
-
-                glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-                draw3DObject(triangle);
-
-                Matrices.model = glm::mat4(1.0f);
-//left
-glm::mat4 translateTriangle12 = glm::translate (glm::vec3(10,-9 ,0 )); // glTranslatef
-                glm::mat4 rotateTriangle12 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1));
-                glm::mat4 scaleTriangle12 = glm::scale (glm::vec3(2, 2, 1)); // glTranslatef
-                // rotate about vector (1,0,0)
-                glm::mat4 triangleTransform12 = translateTriangle12* rotateTriangle12*scaleTriangle12;
-                Matrices.model *= triangleTransform12;
-                //MVP = VP * Matrices.model; // MVP = p * V * M
-    MVP = Matrices.projection * Matrices.view * Matrices.model;
-
-                glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-                draw3DObject(triangle1);
-
-                Matrices.model = glm::mat4(1.0f);
-//up
-glm::mat4 translateTriangle13 = glm::translate (glm::vec3(15,-10 ,0 )); // glTranslatef
-                glm::mat4 rotateTriangle13 = glm::rotate((float)(180*M_PI/180.0f), glm::vec3(0,0,1));
-                glm::mat4 scaleTriangle13 = glm::scale (glm::vec3(2, 2, 1)); // glTranslatef
-                // rotate about vector (1,0,0)
-                glm::mat4 triangleTransform13 = translateTriangle13* rotateTriangle13*scaleTriangle13;
-                Matrices.model *= triangleTransform13;
-                //MVP = VP * Matrices.model; // MVP = p * V * M
-    MVP = Matrices.projection * Matrices.view * Matrices.model;
-
-                glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-                draw3DObject(triangle2);
-
-                Matrices.model = glm::mat4(1.0f);
-//right
-glm::mat4 translateTriangle14 = glm::translate (glm::vec3(15,-15 ,0 )); // glTranslatef
-                glm::mat4 rotateTriangle14 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1));
-                glm::mat4 scaleTriangle14 = glm::scale (glm::vec3(2, 2, 1)); // glTranslatef
-                // rotate about vector (1,0,0)
-                glm::mat4 triangleTransform14 = translateTriangle14* rotateTriangle14*scaleTriangle14;
-                Matrices.model *= triangleTransform14;
-                //MVP = VP * Matrices.model; // MVP = p * V * M
-    MVP = Matrices.projection * Matrices.view * Matrices.model;
-
-                glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-                draw3DObject(triangle3);
-
-  }
-	else if(gamestart==0)
+	// the arrow pad : down, left, up and right
+	submitarrow(9.5,-15,0,fontColor);
+	submitarrow(10,-9,270,fontColor);
+	submitarrow(15,-10,180,fontColor);
+	submitarrow(15,-15,90,fontColor);
+
+  }
+	else if(shown->gamestart==0)
 	{
-		char c[30];
-		strcpy(c,"BLOXORZ");
-		func(100,7,c,-6,8);
-		strcpy(c,"INSTRUCTIONS");
-		func(100,5,c,-14,2);
-		strcpy(c,"1) USE ARROW KEYS TO MOVE BLOCK");
-		func(100,3,c,-14,-1);
-	 	strcpy(c,"2) THERE ARE 4 LEVELS");
-	  func(100,3,c,-14,-3);
-	 	strcpy(c,"3) EACH LEVEL HAS 3 LIVES");
-	  func(100,3,c,-14,-5);
-	 	strcpy(c,"4) PRESS V TO CHANGE VIEW");
-	  func(100,3,c,-14,-7);
-	 	strcpy(c,"5) PRESS B TO CHANGE BLOCK IN LEVEL 4");
-	  func(100,3,c,-14,-9);
-	 	strcpy(c,"6) PRESS ENTER TO START THE GAME");
-	  func(100,3,c,-14,-11);
-		strcpy(c,"7) PRESS Q TO EXIT THE GAME");
-	  func(100,3,c,-14,-13);
+		func(100,7,"BLOXORZ",-6,8);
+		func(100,5,"INSTRUCTIONS",-14,2);
+		func(100,3,"1) USE ARROW KEYS TO MOVE BLOCK",-14,-1);
+	  func(100,3,"2) THERE ARE 4 LEVELS",-14,-3);
+	  func(100,3,"3) EACH LEVEL HAS 3 LIVES",-14,-5);
+	  func(100,3,"4) PRESS V TO CHANGE VIEW",-14,-7);
+	  func(100,3,"5) PRESS B TO CHANGE BLOCK IN LEVEL 4",-14,-9);
+	  func(100,3,"6) PRESS ENTER TO START THE GAME",-14,-11);
+	  func(100,3,"7) PRESS Q TO EXIT THE GAME",-14,-13);
 	}
 	else
 	{
-		char level_str[30];
-		sprintf(level_str,"CONGRATS!! YOU COMPLETED %d LEVELS",level-1);
+		char level_str[40];
+		snprintf(level_str,sizeof(level_str),"CONGRATS!! YOU COMPLETED %d LEVELS",shown->level-1);
 	  func(100,3,level_str,-15,0);
 	}
-  return presentlevel;
+  flushrenderqueue();
 }
-void func(int a,float b,char c[],int x,int y)
+void func(int a,float b,const char c[],int x,int y)
 {
-	glm::mat4 MVP;
 	int fontScale=a;
 	float fontScaleValue =b;
 	glm::vec3 fontColor = getRGBfromHue(fontScale);
-	glUseProgram(fontProgramID);
-	char level_str[30];
-	strcpy(level_str,c);
 	//strcpy(level_str,"BLOXORZ");
 	//sprintf(level_str,"MOVES LEFT:%d",);
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+	// Placed in the fixed 2D ortho projection of the UI layer
 
 	// Transform the text
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateText = glm::translate(glm::vec3(x,y,0));
 	glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
 	Matrices.model *= (translateText * scaleText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	// send font's MVP and font color to fond shaders
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render(level_str);
+	// laid out into the HUD text batch, again only if it changed since the last frame
+	submittext(c,Matrices.model,fontColor);
+}
+/* Window state callbacks of the on-demand loop */
+void windowFocus (GLFWwindow* window, int focus)
+{
+  focused=focus;
+  redraw=true;
+}
+void windowIconify (GLFWwindow* window, int iconify)
+{
+  iconified=iconify;
+  redraw=true;
+}
+void windowRefresh (GLFWwindow* window)
+{
+  redraw=true;
+}
+/* Something moves on every frame : the level dropping in, a roll, or the helicopter view being dragged */
+bool animating()
+{
+  if(gamestart!=1)
+  return false;
+  return levelshift>0 || movecount>0 || gametime-block.rollstart<ROLL_TIME+UPDATE_TICK || (view==VIEW_HELICOPTER && leftmouse==1);
+}
+/* When the HUD next changes by itself : the clock, drawn rounded to the second, or the view name going
+   away. 0 when it never does */
+double nexthudchange(double now)
+{
+  double wake=0;
+  if(gamestart!=1)
+  return 0;
+  wake=start_time+floor(now-start_time+0.5)+0.5;
+  if(now-viewtime<1 && viewtime+1<wake)
+  wake=viewtime+1;
+  return wake;
+}
+/* Between frames : keep to the frame rate limit, taking input meanwhile, then unless something moves
+   sleep until input arrives or the HUD changes. True after such a sleep */
+bool waitforframe(GLFWwindow* window,double framestart)
+{
+  bool slept=false;
+  double now,limit=focused?maxframerate:BACKGROUND_FRAME_RATE;
+  bool moving=statechanged || animating();
+  loopframes++;
+  while(iconified && !glfwWindowShouldClose(window))
+  glfwWaitEvents();
+  if(maxframerate>0 && limit>maxframerate)
+  limit=maxframerate;
+  // A key or button ends the wait early, the game plays it and the render thread draws it at once
+  while(limit>0 && (now=glfwGetTime())<framestart+1/limit && queuedpresses==playedpresses)
+  glfwWaitEventsTimeout(framestart+1/limit-now);
+  glfwPollEvents();
+  if(ondemand && !moving && !redraw)
+  {
+    now=glfwGetTime();
+    double wake=nexthudchange(now);
+    if(wake==0)
+    glfwWaitEvents();
+    else if(wake>now)
+    glfwWaitEventsTimeout(wake-now);
+    idleframes++;
+    slept=true;
+  }
+  redraw=false;
+  return slept;
+}
+void reportframes(double seconds)
+{
+  if(seconds>0)
+  cout<<"Main loop : "<<loopframes<<" frames in "<<seconds<<" s, "<<loopframes/seconds<<" per second, "<<idleframes<<" after sleeping for input or the HUD"<<endl;
+  cout<<"Render thread : "<<snapshotsdrawn<<" of "<<snapshotspublished<<" snapshots drawn"<<endl;
+  if(inputsamples>0)
+  cout<<"Input : "<<playedpresses<<" key and button events, "<<1000*inputlatency/inputsamples<<" ms on average from arrival to swap, "<<inputdropped<<" events dropped"<<endl;
 }
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
+/* Hand the game as it is after the last tick to the render thread, lag being the game time not played yet */
+void publishsnapshot(double lag)
+{
+  Snapshot &s=snapshots[backsnapshot];
+  s.block=block;
+  s.level=level;
+  s.lives=lives;
+  s.moves=present_moves[level];
+  s.gamestart=gamestart;
+  s.view=view;
+  s.board_length=board_length;
+  s.board_width=board_width;
+  s.levelshift=levelshift;
+  s.lastlevelshift=lastlevelshift;
+  s.camera_rotation_angle=camera_rotation_angle;
+  s.gametime=gametime;
+  s.start_time=start_time;
+  s.viewtime=viewtime;
+  s.lag=lag;
+  s.published=glfwGetTime();
+  s.dragging=(view==VIEW_HELICOPTER && leftmouse==1);
+  s.draganchor=lgx;
+  // Keys and buttons played since the last snapshot only count as shown once a tick has moved the game
+  s.inputtime=0;
+  if(gametime!=publishedgametime)
+  {
+    s.inputtime=inputtime;
+    inputtime=0;
+  }
+  publishedgametime=gametime;
+  s.windowwidth=windowwidth;
+  s.windowheight=windowheight;
+  s.boardmode=settings.boardmode;
+  s.indirectdraw=settings.indirectdraw;
+  s.dynamicresolution=settings.dynamicresolution;
+  s.boardserial=boardserial;
+  s.board=handedboard;
+  s.changes=boardchanges;
+  int sent=boardchanges.size();
+  int old=middlesnapshot.exchange(backsnapshot|SNAPSHOT_FRESH);
+  backsnapshot=old&~SNAPSHOT_FRESH;
+  // The slot coming back was taken, so the render thread has what went with the previous snapshot
+  if(!(old&SNAPSHOT_FRESH))
+  {
+    boardchanges.erase(boardchanges.begin(),boardchanges.begin()+sentchanges);
+    sent-=sentchanges;
+    if(sentserial==boardserial)
+    handedboard.reset();
+  }
+  sentchanges=sent;
+  sentserial=boardserial;
+  snapshotspublished++;
+}
+/* Render thread : wait for a snapshot it has not taken, then bring the renderers up to date with it.
+   False once the game is over */
+bool takesnapshot()
+{
+  static int shownserial=0;
+  {
+    unique_lock<mutex> lock(rendermutex);
+    while(rendering && !(middlesnapshot.load()&SNAPSHOT_FRESH))
+    renderwake.wait(lock);
+  }
+  if(!rendering)
+  return false;
+  frontsnapshot=middlesnapshot.exchange(frontsnapshot)&~SNAPSHOT_FRESH;
+  shown=&snapshots[frontsnapshot];
+  if(shown->boardserial!=shownserial)
+  {
+    shownboard=shown->board;
+    showncells.clear();
+    shownserial=shown->boardserial;
+    boardloaded();
+  }
+  int k;
+  for(k=0;k+2<(int)shown->changes.size();k+=3)
+  showcell(shown->changes[k],shown->changes[k+1],shown->changes[k+2]);
+  if(shown->windowwidth!=framewidth || shown->windowheight!=frameheight)
+  {
+    framewidth=shown->windowwidth;
+    frameheight=shown->windowheight;
+    aspect=(float)framewidth/(float)frameheight;
+    glViewport(0,0,framewidth,frameheight);
+  }
+  if(shown->boardmode!=boardmode)
+  {
+    boardmode=shown->boardmode;
+    // The dirty tile list was consumed by the previous renderer, start the new one from scratch
+    bakedlength=texturedlength=-1;
+  }
+  indirectdraw=shown->indirectdraw;
+  if(shown->dynamicresolution!=dynamicresolution)
+  {
+    dynamicresolution=shown->dynamicresolution;
+    renderscale=1;
+  }
+  return true;
+}
+/* Late latching : right before drawing, the helicopter camera takes the cursor as it is now rather than
+   as the game last played it, turning on from the snapshot's angle for the alpha of a tick since */
+void latchinput(float alpha)
+{
+  shownangle=shown->camera_rotation_angle;
+  if(shown->dragging)
+  shownangle-=(cursorx.load(memory_order_relaxed)-shown->draganchor)/800*alpha;
+}
+/* Body of the render thread, which owns the GL context from here on */
+void renderloop(GLFWwindow* window)
+{
+  glfwMakeContextCurrent(window);
+  while(takesnapshot())
+  {
+    double framestart=glfwGetTime();
+    // How far into the next tick the game is by now
+    float alpha=(shown->lag+framestart-shown->published)/UPDATE_TICK;
+    if(alpha>1)
+    alpha=1;
+    latchinput(alpha);
+    // OpenGL Draw commands
+    draw(alpha);
+    glstateframe();
+    // Swap Frame Buffer in double buffering
+    glfwSwapBuffers(window);
+    // The resolution of the next frame follows from how long this one took
+    updaterenderscale(glfwGetTime()-framestart);
+    if(shown->inputtime>0)
+    {
+      inputlatency+=glfwGetTime()-shown->inputtime;
+      inputsamples++;
+    }
+    snapshotsdrawn++;
+  }
+  glfwMakeContextCurrent(NULL);
+}
+/* Main thread : wake the render thread for the snapshot just published, or to stop */
+void wakerenderer()
+{
+  // Passing through the lock makes sure the render thread is either yet to look at the middle slot or
+  // already waiting, so the wake cannot fall between the two
+  {
+    lock_guard<mutex> lock(rendermutex);
+  }
+  renderwake.notify_one();
+}
 GLFWwindow* initGLFW (int width, int height)
 {
     GLFWwindow* window; // window desciptor/handle
@@ -1379,6 +3235,12 @@ GLFWwindow* initGLFW (int width, int height)
 
     /* Register function to handle mouse click */
     glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+    glfwSetCursorPosCallback(window, cursorMotion);   // cursor motion, for dragging the helicopter view
+
+    /* Register functions that wake the on-demand loop */
+    glfwSetWindowFocusCallback(window, windowFocus);
+    glfwSetWindowIconifyCallback(window, windowIconify);
+    glfwSetWindowRefreshCallback(window, windowRefresh);
 
     return window;
 }
@@ -1390,12 +3252,31 @@ void initGL (GLFWwindow* window, int width, int height)
     /* Objects should be created before any other gl function and shaders */
 	// Create the models
 	// Create and compile our GLSL program from the shaders
+  resetglstate();
   createtile(1,1,1,1,0.4,0.2,0,1,0.7,0.4,0);
   createtile(1,1,1,1,0.4,0.2,0,1,0.7,0.4,1);
-	createTriangle();
+  createtilecache();
+  createorientations();
+  createboardinstances();
+  createbakedboard();
+  createmeshedboard();
+  createtextureboard();
+  createswitches();
+  createstaticpack();
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Get a handle for our "M" uniform, the view and projection come from the FrameMatrices block
+	Matrices.ModelID = glGetUniformLocation(programID, "M");
+	Matrices.DrawModeID = glGetUniformLocation(programID, "drawmode");
+	useprogram(programID);
+	glUniform3fv(glGetUniformLocation(programID, "palette"), 2*TILE_KINDS, &tilepalette[0][0][0]);
+	glUniform1i(glGetUniformLocation(programID, "boardtiles"), 0);
+	glUniform1i(glGetUniformLocation(programID, "drawrecords"), 1);
+	Matrices.FirstCellID = glGetUniformLocation(programID, "firstcell");
+	Matrices.DrawnCellsID = glGetUniformLocation(programID, "drawncells");
+	Matrices.BoardOriginID = glGetUniformLocation(programID, "boardorigin");
+	Matrices.RollPivotID = glGetUniformLocation(programID, "rollpivot");
+	Matrices.RollAxisID = glGetUniformLocation(programID, "rollaxis");
+	Matrices.RollAngleID = glGetUniformLocation(programID, "rollangle");
 
 
 	reshapeWindow (window, width, height);
@@ -1407,30 +3288,26 @@ void initGL (GLFWwindow* window, int width, int height)
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
 
-	const char* fontfile = "monaco.ttf";
-	GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
-
-	if(GL3Font.font->Error())
+	// monaco.ttf baked by fontbake, see the Makefile
+	const char* fontfile = "monaco.font";
+	if(!loadtextatlas(fontfile))
 	{
 		cout << "Error: Could not load font `" << fontfile << "'" << endl;
 		glfwTerminate();
 		exit(EXIT_FAILURE);
 	}
+	// The UI layer has its own projection, it does not read the frame matrices
+	uiProgramID = LoadShaders( "uibatch.vert", "uibatch.frag" );
+	useprogram(uiProgramID);
+	glUniform1i(glGetUniformLocation(uiProgramID, "atlas"), 0);
+	UiProjectionID = glGetUniformLocation(uiProgramID, "uiprojection");
 
-	// Create and compile our GLSL program from the font shaders
-	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
-
-	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
-	GL3Font.font->FaceSize(1);
-	GL3Font.font->Depth(0);
-	GL3Font.font->Outset(0, 0);
-GL3Font.font->CharMap(ft_encoding_unicode);
+	// The scene programs read the frame matrices from the uniform buffer
+	glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "FrameMatrices"), FRAME_MATRICES_BINDING);
+	glGenBuffers(1, &FrameMatricesBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, FrameMatricesBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(frame), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_MATRICES_BINDING, FrameMatricesBuffer);
 
 
 
@@ -1439,30 +3316,69 @@ GL3Font.font->CharMap(ft_encoding_unicode);
     cout << "VERSION: " << glGetString(GL_VERSION) << endl;
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
-void initialiselevel()
+/* A generatedsize x generatedsize level played instead of level 1 : solid ground with scattered holes
+   and fragile tiles, the block starts in the same cell as in level 1 and the goal is near the far corner.
+   The board is only generated the first time, every later try plays generatedboard again */
+void generatelevel()
 {
-	count=0;
-  //cout<<level<<endl;
-  int i,j;
-  for(i=0;i<100;i++)
+  int i,j,n=generatedsize;
+  if(!generatedboard)
   {
-    for(j=0;j<100;j++)
+  a.resize(n,n);
+  for(i=0;i<n;i++)
+  {
+    for(j=0;j<n;j++)
     {
-      a[i][j]=0;
+      unsigned h=(unsigned)i*73856093u^(unsigned)j*19349663u;
+      h=(h^(h>>13))*0x5bd1e995u;
+      h>>=8;
+      a[i][j]=(h%23==0)?0:(h%11==0)?2:1;
     }
   }
+  for(i=0;i<5;i++)
+  for(j=0;j<5;j++)
+  a[i][j]=1;
+  for(i=n-5;i<n;i++)
+  for(j=n-5;j<n;j++)
+  a[i][j]=1;
+  a[n-3][n-3]=0;
+  generatedboard=shared_ptr<const Board>(new Board(std::move(a)));
+  }
+  block.x1=-8;
+  block.y1=0;
+  block.z1=1.2;
+  block.x2=-8;
+  block.y2=0;
+  block.z2=3.2;
+  board_length=10;
+  board_width=6;
+  block.goal_x=n-3;
+  block.goal_y=n-3;
+  block.anglex=0;
+  block.angley=0;
+  block.translatex=0;
+  block.translatey=0;
+}
+void initialiselevel()
+{
+	count=0;
+  // moves still queued from the last try are not played on this one
+  movecount=0;
+  //cout<<level<<endl;
+  int i,j;
+  a.resize(100,100);
 
-  block.rotationmatrix[0]= glm::mat4(1.0f);
-  block.rotationmatrix[1]= glm::mat4(1.0f);
-  zshift=4;
-  left_angle=0;
-  right_angle=0;
-  up_angle=0;
-  down_angle=0;
+  block.orientation[0]=0;
+  block.orientation[1]=0;
+  levelshift=lastlevelshift=4;
+  block.rollangle[0]=0;
+  block.rollangle[1]=0;
   block.l=1;
   block.w=1;
   block.h=1;
-  if(level==1)
+  if(level==1 && generatedsize>0)
+  generatelevel();
+  else if(level==1)
   {
   num_of_tiles=35;
   for(j=1;j<=3;j++)
@@ -1630,19 +3546,51 @@ if(level==4)
   active_circle=0;
   active_into=0;
 }
+  handboard();
 }
 int main (int argc, char** argv)
 {
 	int width = 1000;
 	int height =1000,newlevel=0;
+  // "sample2D 4096" plays a generated 4096x4096 level first, drawn by the chunked renderer,
+  // "sample2D -fps 30" limits the frame rate to 30, "sample2D -stats" prints the renderer's counters at exit
+  int arg;
+  for(arg=1;arg<argc;arg++)
+  {
+    if(!strcmp(argv[arg],"-fps") && arg+1<argc)
+    maxframerate=atof(argv[++arg]);
+    else if(!strcmp(argv[arg],"-stats"))
+    printstats=true;
+    else
+    generatedsize=atoi(argv[arg]);
+  }
+  if(generatedsize<0 || generatedsize>8192)
+  generatedsize=0;
+  if(generatedsize>0)
+  {
+    if(generatedsize<BOARD_SIZE)
+    generatedsize=BOARD_SIZE;
+    moves[1]=4*generatedsize;
+    settings.boardmode=BOARD_CHUNKED;
+  }
 
   GLFWwindow* window = initGLFW(width, height);
 	initGL (window, width, height);
+  // The GL context moves to the render thread, this thread plays the game and handles input
+  glfwMakeContextCurrent(NULL);
+  thread renderer(renderloop,window);
 
-    double last_update_time = glfwGetTime();
+    // lag : game time not played yet, one tick's worth so that the first frame starts the level
+    double framestart = glfwGetTime(),lag=UPDATE_TICK;
 		start_time=glfwGetTime();
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
+        // The game plays the time the last frame took in fixed ticks, then the frame shows how far
+        // into the next tick it is
+        int ticks;
+        playinput();
+        for(ticks=0;lag>=UPDATE_TICK && ticks<MAX_TICKS_PER_FRAME;ticks++)
+        {
         if(newlevel==0)
         {
           newlevel=1;
@@ -1660,8 +3608,8 @@ int main (int argc, char** argv)
 				system("mpg123 -vC sounds/2.mp3 &");
         initialiselevel();
         }
-        // OpenGL Draw commands
-        newlevel=draw(level);
+        drag();
+        newlevel=update(level);
 				if(lives>0 && presentlives!=lives)
 				{
 					presentlives=lives;
@@ -1670,15 +3618,36 @@ int main (int argc, char** argv)
 					system("mpg123 -vC sounds/2.mp3 &");
 					initialiselevel();
 				}
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
-
-        // Poll for Keyboard and mouse events
-        glfwPollEvents();
-				drag(window);
+        lag-=UPDATE_TICK;
+        }
+        if(lag>=UPDATE_TICK)
+        lag=fmod(lag,UPDATE_TICK);
+        // The render thread draws the game as it is now whenever it is done with its last frame
+        publishsnapshot(lag);
+        wakerenderer();
+
+        // Keyboard and mouse events, then wait for the next frame to be due. Time asleep with nothing
+        // moving is not played
+        bool slept=waitforframe(window,framestart);
+        double now=glfwGetTime();
+        if(!slept)
+        lag+=now-framestart;
+        // A key or button that ended the wait is played on the next pass, not a tick later
+        if(queuedpresses!=playedpresses && lag<UPDATE_TICK)
+        lag=UPDATE_TICK;
+        framestart=now;
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s
     }
 
+    rendering=false;
+    wakerenderer();
+    renderer.join();
+    if(printstats)
+    {
+      reportglstate();
+      reportrenderqueue();
+      reportframes(glfwGetTime()-start_time);
+    }
     glfwTerminate();
 //    exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,26 @@
+/* Font atlas baked by fontbake from a TrueType font and loaded by the game with a single read.
+   The file is a FontAtlasHeader, then numglyphs FontGlyph for the characters from firstchar on,
+   then width x height bytes of signed distance field, rows top to bottom.
+   A texel is 128 on the outline of a glyph and moves by 127 over spread texels, up inside and down outside */
+#ifndef FONTATLAS_H
+#define FONTATLAS_H
+
+#include <stdint.h>
+
+#define FONT_ATLAS_MAGIC 0x41464453   // "SDFA"
+#define FONT_ATLAS_VERSION 1
+
+struct FontAtlasHeader {
+  uint32_t magic,version;
+  uint32_t width,height;
+  uint32_t firstchar,numglyphs;
+  float em;                      // atlas texels per em
+  float spread;                  // texels of distance the field covers on each side of the outline
+};
+struct FontGlyph {
+  float u0,v0,u1,v1;             // atlas rectangle, v0 at the top
+  float left,top,width,height;   // quad relative to the pen, in ems, the field's margin included
+  float advance;
+};
+
+#endif
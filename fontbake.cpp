@@ -0,0 +1,182 @@
+/* fontbake : bake the printable ASCII glyphs of a TrueType font into the signed distance field atlas
+   of fontatlas.h. Run at build time, see the Makefile, so that the game needs no FreeType.
+   Usage : fontbake font.ttf font.font */
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include "fontatlas.h"
+
+using namespace std;
+
+#define FIRST_CHAR 32
+#define LAST_CHAR 126
+#define ATLAS_EM 48        // atlas texels per em
+#define ATLAS_WIDTH 512
+#define SPREAD 6           // texels of distance field on each side of the outline
+#define OVERSAMPLE 8       // the outlines are rasterised this much finer than the atlas
+#define INF 1e20f
+
+/* Felzenszwalb and Huttenlocher : squared distance transform of f along one line, into d */
+void edt1d(const float *f,float *d,int n,vector<int> &v,vector<float> &z)
+{
+  int k=0,q;
+  v[0]=0;
+  z[0]=-INF;
+  z[1]=INF;
+  for(q=1;q<n;q++)
+  {
+    float s=((f[q]+q*q)-(f[v[k]]+v[k]*v[k]))/(2*q-2*v[k]);
+    while(s<=z[k])
+    {
+      k--;
+      s=((f[q]+q*q)-(f[v[k]]+v[k]*v[k]))/(2*q-2*v[k]);
+    }
+    k++;
+    v[k]=q;
+    z[k]=s;
+    z[k+1]=INF;
+  }
+  for(k=0,q=0;q<n;q++)
+  {
+    while(z[k+1]<q)
+    k++;
+    d[q]=(q-v[k])*(q-v[k])+f[v[k]];
+  }
+}
+/* Squared distance of every texel to the nearest texel where grid is 0, columns then rows */
+void edt2d(vector<float> &grid,int w,int h)
+{
+  int n=w>h?w:h,x,y;
+  vector<float> f(n),d(n),z(n+1);
+  vector<int> v(n);
+  for(x=0;x<w;x++)
+  {
+    for(y=0;y<h;y++) f[y]=grid[y*w+x];
+    edt1d(&f[0],&d[0],h,v,z);
+    for(y=0;y<h;y++) grid[y*w+x]=d[y];
+  }
+  for(y=0;y<h;y++)
+  {
+    for(x=0;x<w;x++) f[x]=grid[y*w+x];
+    edt1d(&f[0],&d[0],w,v,z);
+    for(x=0;x<w;x++) grid[y*w+x]=d[x];
+  }
+}
+/* Distance field of a glyph bitmap rasterised OVERSAMPLE times finer, w x h atlas texels with the SPREAD margin */
+void glyphfield(FT_Bitmap &bitmap,int w,int h,unsigned char *field)
+{
+  int pad=SPREAD*OVERSAMPLE,W=w*OVERSAMPLE,H=h*OVERSAMPLE,x,y;
+  vector<float> outside(W*H),inside(W*H);
+  for(y=0;y<H;y++)
+  {
+    for(x=0;x<W;x++)
+    {
+      int bx=x-pad,by=y-pad;
+      bool in=bx>=0 && by>=0 && bx<(int)bitmap.width && by<(int)bitmap.rows && bitmap.buffer[by*bitmap.pitch+bx]>=128;
+      outside[y*W+x]=in?0:INF;
+      inside[y*W+x]=in?INF:0;
+    }
+  }
+  edt2d(outside,W,H);
+  edt2d(inside,W,H);
+  // sample each atlas texel at its centre, distances back in atlas texels
+  for(y=0;y<h;y++)
+  {
+    for(x=0;x<w;x++)
+    {
+      int s=(y*OVERSAMPLE+OVERSAMPLE/2)*W+x*OVERSAMPLE+OVERSAMPLE/2;
+      float dist=(sqrtf(inside[s])-sqrtf(outside[s]))/OVERSAMPLE;
+      float value=128+127*dist/SPREAD;
+      field[y*w+x]=value<0?0:value>255?255:(unsigned char)(value+0.5f);
+    }
+  }
+}
+int main(int argc,char **argv)
+{
+  FT_Library library;
+  FT_Face face;
+  FontAtlasHeader header;
+  FontGlyph glyphs[LAST_CHAR-FIRST_CHAR+1];
+  vector<unsigned char> atlas;
+  int c,x=0,y=0,rowheight=0,height=0;
+  if(argc!=3)
+  {
+    cout<<"usage : fontbake font.ttf font.font"<<endl;
+    return 1;
+  }
+  if(FT_Init_FreeType(&library) || FT_New_Face(library,argv[1],0,&face))
+  {
+    cout<<"fontbake : could not load "<<argv[1]<<endl;
+    return 1;
+  }
+  FT_Set_Pixel_Sizes(face,0,ATLAS_EM*OVERSAMPLE);
+  memset(glyphs,0,sizeof(glyphs));
+  for(c=FIRST_CHAR;c<=LAST_CHAR;c++)
+  {
+    FontGlyph &g=glyphs[c-FIRST_CHAR];
+    if(FT_Load_Char(face,c,FT_LOAD_RENDER))
+    continue;
+    FT_GlyphSlot slot=face->glyph;
+    g.advance=slot->advance.x/64.0f/(ATLAS_EM*OVERSAMPLE);
+    if(slot->bitmap.width==0 || slot->bitmap.rows==0)
+    continue;
+    // the margin holds the outside of the field, the glyph starts at a whole atlas texel
+    int w=(slot->bitmap.width+OVERSAMPLE-1)/OVERSAMPLE+2*SPREAD,h=(slot->bitmap.rows+OVERSAMPLE-1)/OVERSAMPLE+2*SPREAD,r;
+    if(x+w>ATLAS_WIDTH)
+    {
+      x=0;
+      y+=rowheight;
+      rowheight=0;
+    }
+    if(y+h>height)
+    {
+      height=y+h;
+      atlas.resize(ATLAS_WIDTH*height,0);
+    }
+    vector<unsigned char> field(w*h);
+    glyphfield(slot->bitmap,w,h,&field[0]);
+    for(r=0;r<h;r++)
+    memcpy(&atlas[(y+r)*ATLAS_WIDTH+x],&field[r*w],w);
+    g.u0=x;
+    g.v0=y;
+    g.u1=x+w;
+    g.v1=y+h;
+    g.left=((float)slot->bitmap_left/OVERSAMPLE-SPREAD)/ATLAS_EM;
+    g.top=((float)slot->bitmap_top/OVERSAMPLE+SPREAD)/ATLAS_EM;
+    g.width=(float)w/ATLAS_EM;
+    g.height=(float)h/ATLAS_EM;
+    x+=w;
+    if(h>rowheight)
+    rowheight=h;
+  }
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  for(c=0;c<=LAST_CHAR-FIRST_CHAR;c++)
+  {
+    glyphs[c].u0/=ATLAS_WIDTH;
+    glyphs[c].u1/=ATLAS_WIDTH;
+    glyphs[c].v0/=height;
+    glyphs[c].v1/=height;
+  }
+  header.magic=FONT_ATLAS_MAGIC;
+  header.version=FONT_ATLAS_VERSION;
+  header.width=ATLAS_WIDTH;
+  header.height=height;
+  header.firstchar=FIRST_CHAR;
+  header.numglyphs=LAST_CHAR-FIRST_CHAR+1;
+  header.em=ATLAS_EM;
+  header.spread=SPREAD;
+  FILE *out=fopen(argv[2],"wb");
+  if(!out || fwrite(&header,sizeof(header),1,out)!=1 || fwrite(glyphs,sizeof(glyphs),1,out)!=1 ||
+     fwrite(&atlas[0],atlas.size(),1,out)!=1 || fclose(out)!=0)
+  {
+    cout<<"fontbake : could not write "<<argv[2]<<endl;
+    return 1;
+  }
+  cout<<"fontbake : "<<argv[2]<<" "<<ATLAS_WIDTH<<"x"<<height<<" atlas, "<<header.numglyphs<<" glyphs"<<endl;
+  return 0;
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+in vec2 fragAtlasCoord;
+in vec3 fragColor;
+
+// signed distance field of the glyphs : 0.5 on the outline, more inside
+uniform sampler2D atlas;
+
+out vec4 color;
+
+void main()
+{
+    // shapes are not in the atlas, they are filled
+    if (fragAtlasCoord.x < 0.0)
+    {
+        color = vec4(fragColor, 1.0);
+        return;
+    }
+    float distance = texture(atlas, fragAtlasCoord).r;
+    // an edge about one pixel wide, whatever the size the text is drawn at
+    float edge = fwidth(distance) * 0.7;
+    float coverage = smoothstep(0.5 - edge, 0.5 + edge, distance);
+    // the empty parts of a quad must not hide the glyph next to it
+    if (coverage < 0.01)
+        discard;
+    color = vec4(fragColor, coverage);
+}
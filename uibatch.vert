@@ -0,0 +1,20 @@
+#version 330 core
+
+// fixed 2D ortho projection of the UI layer, whatever the camera of the scene
+uniform mat4 uiprojection;
+
+// corner of a glyph quad or outline edge, already placed by the model matrix of its element,
+// its place in the glyph atlas (u < 0 for solid shapes) and the colour of the element
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec2 atlasCoord;
+layout (location = 2) in vec3 vertexColor;
+
+out vec2 fragAtlasCoord;
+out vec3 fragColor;
+
+void main ()
+{
+    gl_Position = uiprojection * vec4(vertexPosition, 1.0);
+    fragAtlasCoord = atlasCoord;
+    fragColor = vertexColor;
+}